@@ -0,0 +1,374 @@
+#ifndef BVH_H
+#define BVH_H
+
+// Bounding volume hierarchy over the triangles of a Mesh, built with binned
+// SAH. Building reorders the triangles so that every node covers a
+// contiguous range of them, and renumbers the vertices in order of first
+// use so that the vertices of a node are mostly contiguous as well. Culling
+// against a set of planes then yields the visible triangles and vertices as
+// a few ranges, at a cost that grows with what is visible, not the scene.
+
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include "Mesh.h"
+
+const int BVH_BINS = 12;
+const int BVH_MAX_LEAF = 16;            // Larger nodes are always split
+
+struct BVHNode
+{
+    glm::vec3 min, max;
+    int first, count;                   // Triangles of the whole subtree
+    int left;                           // Children left and left+1, -1 for a leaf
+    int vertexBegin, vertexEnd;         // Holds every vertex of the subtree
+};
+
+// Half-open range of triangles or vertices.
+struct BVHRange
+{
+    int begin, end;
+};
+
+class BVH
+{
+public:
+    std::vector<BVHNode> nodes;         // The root is node 0
+};
+
+// Result of CullBVH.
+struct BVHVisible
+{
+    std::vector<BVHRange> triangles;    // Sorted and disjoint
+    std::vector<BVHRange> vertices;     // Sorted and disjoint
+    int culled;                         // Triangles in nodes outside the planes
+    int occluded;                       // Triangles in hidden nodes
+};
+
+// Bounds of triangles and of their centroids, used while building.
+struct BVHBounds
+{
+    glm::vec3 min, max;
+
+    BVHBounds()
+        : min( 1e30f ), max( -1e30f )
+    {
+    }
+
+    void Add( const glm::vec3& p )
+    {
+        min = glm::min( min, p );
+        max = glm::max( max, p );
+    }
+
+    void Add( const BVHBounds& b )
+    {
+        min = glm::min( min, b.min );
+        max = glm::max( max, b.max );
+    }
+
+    float Area() const
+    {
+        glm::vec3 d = max-min;
+        if( d.x < 0 )
+            return 0;
+        return d.x*d.y + d.y*d.z + d.z*d.x;
+    }
+};
+
+// Splits node into two children if the surface area heuristic says so.
+inline void SplitBVHNode( BVH& bvh, int node, std::vector<int>& order,
+                          const std::vector<BVHBounds>& boxes,
+                          const std::vector<glm::vec3>& centroids )
+{
+    const int first = bvh.nodes[node].first;
+    const int count = bvh.nodes[node].count;
+
+    BVHBounds bounds, centroidBounds;
+    for( int i=first; i<first+count; ++i )
+    {
+        bounds.Add( boxes[order[i]] );
+        centroidBounds.Add( centroids[order[i]] );
+    }
+    bvh.nodes[node].min = bounds.min;
+    bvh.nodes[node].max = bounds.max;
+    bvh.nodes[node].left = -1;
+    if( count <= 2 )
+        return;
+
+    // Find the cheapest split between bins along any axis. The cost of a
+    // leaf is its triangle count, and of a split the triangles on each side
+    // weighted by the chance that a ray through the node hits that side.
+    int bestAxis = -1;
+    int bestSplit = 0;
+    float bestCost = float(count);
+    glm::vec3 extent = centroidBounds.max-centroidBounds.min;
+    for( int axis=0; axis<3; ++axis )
+    {
+        if( extent[axis] <= 0 )
+            continue;
+        BVHBounds binBounds[BVH_BINS];
+        int binCounts[BVH_BINS] = { 0 };
+        float scale = BVH_BINS / extent[axis];
+        for( int i=first; i<first+count; ++i )
+        {
+            int bin = std::min( int((centroids[order[i]][axis]-centroidBounds.min[axis])*scale), BVH_BINS-1 );
+            binBounds[bin].Add( boxes[order[i]] );
+            ++binCounts[bin];
+        }
+
+        float rightArea[BVH_BINS];
+        int rightCount[BVH_BINS];
+        BVHBounds right;
+        int n = 0;
+        for( int b=BVH_BINS-1; b>0; --b )
+        {
+            right.Add( binBounds[b] );
+            n += binCounts[b];
+            rightArea[b] = right.Area();
+            rightCount[b] = n;
+        }
+
+        BVHBounds left;
+        n = 0;
+        for( int b=1; b<BVH_BINS; ++b )
+        {
+            left.Add( binBounds[b-1] );
+            n += binCounts[b-1];
+            float cost = 0.125f + (left.Area()*n + rightArea[b]*rightCount[b]) / bounds.Area();
+            if( n > 0 && rightCount[b] > 0 && cost < bestCost )
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = b;
+            }
+        }
+    }
+
+    int middle;
+    if( bestAxis >= 0 )
+    {
+        float scale = BVH_BINS / extent[bestAxis];
+        float minimum = centroidBounds.min[bestAxis];
+        middle = int( std::partition( order.begin()+first, order.begin()+first+count,
+            [&]( int t )
+            {
+                return std::min( int((centroids[t][bestAxis]-minimum)*scale), BVH_BINS-1 ) < bestSplit;
+            } ) - order.begin() );
+    }
+    else if( count > BVH_MAX_LEAF )
+    {
+        // Too large for a leaf but no split helps: halve it along the
+        // longest axis.
+        int axis = 0;
+        if( extent.y > extent[axis] ) axis = 1;
+        if( extent.z > extent[axis] ) axis = 2;
+        middle = first + count/2;
+        std::nth_element( order.begin()+first, order.begin()+middle, order.begin()+first+count,
+            [&]( int a, int b ) { return centroids[a][axis] < centroids[b][axis]; } );
+    }
+    else
+        return;
+
+    BVHNode child;
+    child.left = -1;
+    child.vertexBegin = child.vertexEnd = 0;
+    child.first = first;
+    child.count = middle-first;
+    bvh.nodes[node].left = int(bvh.nodes.size());
+    bvh.nodes.push_back( child );
+    child.first = middle;
+    child.count = first+count-middle;
+    bvh.nodes.push_back( child );
+}
+
+// Builds the hierarchy and reorders the triangles and vertices of the mesh
+// to match it.
+inline void BuildBVH( Mesh& mesh, BVH& bvh )
+{
+    const int triangles = mesh.TriangleCount();
+    std::vector<BVHBounds> boxes( triangles );
+    std::vector<glm::vec3> centroids( triangles );
+    std::vector<int> order( triangles );
+    for( int i=0; i<triangles; ++i )
+    {
+        for( int j=0; j<3; ++j )
+            boxes[i].Add( mesh.Position( i, j ) );
+        centroids[i] = 0.5f*(boxes[i].min+boxes[i].max);
+        order[i] = i;
+    }
+
+    // Children are always added after their parent, so a single pass over
+    // the growing node array splits the whole tree.
+    bvh.nodes.clear();
+    BVHNode root;
+    root.left = -1;
+    root.vertexBegin = root.vertexEnd = 0;
+    root.first = 0;
+    root.count = triangles;
+    bvh.nodes.push_back( root );
+    for( size_t node=0; node<bvh.nodes.size(); ++node )
+        SplitBVHNode( bvh, int(node), order, boxes, centroids );
+
+    // Put the triangles in leaf order and number the vertices by first use.
+    std::vector<int> indices( 3*triangles );
+    std::vector<glm::vec3> normals( triangles ), colors( triangles );
+    std::vector<int> newIndex( mesh.positions.size(), -1 );
+    std::vector<glm::vec3> positions;
+    positions.reserve( mesh.positions.size() );
+    for( int i=0; i<triangles; ++i )
+    {
+        int t = order[i];
+        for( int j=0; j<3; ++j )
+        {
+            int v = mesh.indices[3*t+j];
+            if( newIndex[v] < 0 )
+            {
+                newIndex[v] = int(positions.size());
+                positions.push_back( mesh.positions[v] );
+            }
+            indices[3*i+j] = newIndex[v];
+        }
+        normals[i] = mesh.normals[t];
+        colors[i] = mesh.colors[t];
+    }
+    mesh.indices.swap( indices );
+    mesh.normals.swap( normals );
+    mesh.colors.swap( colors );
+    mesh.positions.swap( positions );
+    for( size_t i=0; i<mesh.positions.size(); ++i )
+    {
+        mesh.x[i] = mesh.positions[i].x;
+        mesh.y[i] = mesh.positions[i].y;
+        mesh.z[i] = mesh.positions[i].z;
+    }
+
+    // Vertex ranges, children before parents.
+    for( int node=int(bvh.nodes.size())-1; node>=0; --node )
+    {
+        BVHNode& n = bvh.nodes[node];
+        if( n.left < 0 )
+        {
+            n.vertexBegin = int(mesh.positions.size());
+            n.vertexEnd = 0;
+            for( int i=3*n.first; i<3*(n.first+n.count); ++i )
+            {
+                n.vertexBegin = std::min( n.vertexBegin, mesh.indices[i] );
+                n.vertexEnd = std::max( n.vertexEnd, mesh.indices[i]+1 );
+            }
+        }
+        else
+        {
+            const BVHNode& a = bvh.nodes[n.left];
+            const BVHNode& b = bvh.nodes[n.left+1];
+            n.vertexBegin = std::min( a.vertexBegin, b.vertexBegin );
+            n.vertexEnd = std::max( a.vertexEnd, b.vertexEnd );
+        }
+    }
+}
+
+// Appends a range, merging it with the last one if they touch.
+inline void AddBVHRange( std::vector<BVHRange>& ranges, int begin, int end )
+{
+    if( begin >= end )
+        return;
+    if( !ranges.empty() && ranges.back().end >= begin )
+        ranges.back().end = std::max( ranges.back().end, end );
+    else
+    {
+        BVHRange r = { begin, end };
+        ranges.push_back( r );
+    }
+}
+
+// Sorts ranges and merges those that overlap or touch.
+inline void MergeBVHRanges( std::vector<BVHRange>& ranges )
+{
+    std::sort( ranges.begin(), ranges.end(),
+        []( const BVHRange& a, const BVHRange& b ) { return a.begin < b.begin; } );
+    std::vector<BVHRange> merged;
+    for( size_t i=0; i<ranges.size(); ++i )
+        AddBVHRange( merged, ranges[i].begin, ranges[i].end );
+    ranges.swap( merged );
+}
+
+// Finds the triangles and vertices of the nodes that are not completely
+// outside one of the world space half-spaces a*x + b*y + c*z + d >= 0, and
+// for which occluded, if given, returns false. Nodes completely inside all
+// planes are accepted without visiting their children, unless there is an
+// occluded test, which may still reject them.
+inline void CullBVH( const BVH& bvh, const glm::vec4* planes, int planeCount, BVHVisible& out,
+                     const std::function<bool(const BVHNode&)>& occluded = nullptr )
+{
+    out.triangles.clear();
+    out.vertices.clear();
+    out.culled = 0;
+    out.occluded = 0;
+    if( bvh.nodes.empty() || bvh.nodes[0].count == 0 )
+        return;
+
+    struct Entry
+    {
+        int node;
+        int planes;                     // Bit i set: not yet inside planes[i]
+    };
+    Entry stack[64];
+    int top = 0;
+    Entry root = { 0, (1 << planeCount)-1 };
+    stack[top++] = root;
+
+    while( top > 0 )
+    {
+        Entry e = stack[--top];
+        const BVHNode& n = bvh.nodes[e.node];
+
+        bool outside = false;
+        for( int i=0; i<planeCount && !outside; ++i )
+        {
+            if( !(e.planes & (1 << i)) )
+                continue;
+            const glm::vec4& p = planes[i];
+            // The corners farthest along and against the plane normal.
+            glm::vec3 front( p.x >= 0 ? n.max.x : n.min.x,
+                             p.y >= 0 ? n.max.y : n.min.y,
+                             p.z >= 0 ? n.max.z : n.min.z );
+            glm::vec3 back( p.x >= 0 ? n.min.x : n.max.x,
+                            p.y >= 0 ? n.min.y : n.max.y,
+                            p.z >= 0 ? n.min.z : n.max.z );
+            if( glm::dot( glm::vec3(p), front ) + p.w < 0 )
+                outside = true;
+            else if( glm::dot( glm::vec3(p), back ) + p.w >= 0 )
+                e.planes &= ~(1 << i);
+        }
+        if( outside )
+        {
+            out.culled += n.count;
+            continue;
+        }
+        if( occluded && occluded( n ) )
+        {
+            out.occluded += n.count;
+            continue;
+        }
+
+        if( n.left < 0 || (e.planes == 0 && !occluded) || top+2 > 64 )
+        {
+            AddBVHRange( out.triangles, n.first, n.first+n.count );
+            out.vertices.push_back( BVHRange() );
+            out.vertices.back().begin = n.vertexBegin;
+            out.vertices.back().end = n.vertexEnd;
+            continue;
+        }
+
+        // The left child is popped first, which keeps the triangle ranges
+        // in ascending order.
+        Entry right = { n.left+1, e.planes };
+        Entry left = { n.left, e.planes };
+        stack[top++] = right;
+        stack[top++] = left;
+    }
+    MergeBVHRanges( out.vertices );
+}
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef FRAME_ARENA_H
+#define FRAME_ARENA_H
+
+// A bump allocator for memory that lives at most one frame. Allocation moves
+// a pointer forward, freeing single allocations does nothing, and Reset
+// releases everything at once while keeping the blocks for the next frame.
+// An arena is not thread safe; every thread uses its own.
+
+#include <cstddef>
+#include <cstdlib>
+#include <stdint.h>
+#include <new>
+#include <vector>
+
+class FrameArena
+{
+public:
+    // Position in the arena, to release everything allocated after it.
+    struct Marker
+    {
+        size_t block;
+        size_t used;
+    };
+
+    explicit FrameArena( size_t blockSize = 64*1024 )
+        : blockSize(blockSize), current(0), used(0), frame(0)
+    {
+    }
+
+    ~FrameArena()
+    {
+        for( size_t i=0; i<blocks.size(); ++i )
+            free( blocks[i].data );
+    }
+
+    void* Allocate( size_t bytes, size_t align = 16 )
+    {
+        // Continue in the next block that is large enough. Blocks are only
+        // added when none of the existing ones can hold the allocation.
+        for( ;; )
+        {
+            if( current == blocks.size() )
+            {
+                Block block;
+                block.size = bytes + align > blockSize ? bytes + align : blockSize;
+                block.data = (char*)malloc( block.size );
+                if( block.data == 0 )
+                    throw std::bad_alloc();
+                blocks.push_back( block );
+            }
+
+            char* data = blocks[current].data;
+            size_t start = AlignUp( data+used, align ) - data;
+            if( start + bytes <= blocks[current].size )
+            {
+                used = start + bytes;
+                return data + start;
+            }
+            ++current;
+            used = 0;
+        }
+    }
+
+    template<class T>
+    T* Allocate( size_t count )
+    {
+        return (T*)Allocate( count*sizeof(T), alignof(T) < 16 ? 16 : alignof(T) );
+    }
+
+    Marker Mark() const
+    {
+        Marker m = { current, used };
+        return m;
+    }
+
+    void Release( const Marker& m )
+    {
+        current = m.block;
+        used = m.used;
+    }
+
+    void Reset()
+    {
+        current = 0;
+        used = 0;
+    }
+
+    // Resets the arena the first time it is used in a new frame.
+    void BeginFrame( unsigned number )
+    {
+        if( number != frame )
+        {
+            Reset();
+            frame = number;
+        }
+    }
+
+private:
+    struct Block
+    {
+        char* data;
+        size_t size;
+    };
+
+    static char* AlignUp( char* p, size_t align )
+    {
+        return (char*)(((uintptr_t)p + align-1) & ~(uintptr_t)(align-1));
+    }
+
+    std::vector<Block> blocks;
+    size_t blockSize;
+    size_t current;
+    size_t used;
+    unsigned frame;
+};
+
+// Releases everything allocated from the arena during its lifetime.
+class ArenaScope
+{
+public:
+    explicit ArenaScope( FrameArena& arena )
+        : arena(arena), marker(arena.Mark())
+    {
+    }
+
+    ~ArenaScope()
+    {
+        arena.Release( marker );
+    }
+
+private:
+    ArenaScope( const ArenaScope& );
+    ArenaScope& operator=( const ArenaScope& );
+
+    FrameArena& arena;
+    FrameArena::Marker marker;
+};
+
+// Standard allocator on top of an arena, so that std::vector temporaries
+// can be placed in it: vector<T, ArenaAllocator<T> > v( n, T(), arena ).
+template<class T>
+class ArenaAllocator
+{
+public:
+    typedef T value_type;
+
+    ArenaAllocator( FrameArena& arena )
+        : arena(&arena)
+    {
+    }
+
+    template<class U>
+    ArenaAllocator( const ArenaAllocator<U>& other )
+        : arena(other.arena)
+    {
+    }
+
+    T* allocate( size_t n )
+    {
+        return arena->Allocate<T>( n );
+    }
+
+    void deallocate( T*, size_t )
+    {
+    }
+
+    template<class U>
+    bool operator==( const ArenaAllocator<U>& other ) const
+    {
+        return arena == other.arena;
+    }
+
+    template<class U>
+    bool operator!=( const ArenaAllocator<U>& other ) const
+    {
+        return arena != other.arena;
+    }
+
+private:
+    template<class U> friend class ArenaAllocator;
+
+    FrameArena* arena;
+};
+
+#endif
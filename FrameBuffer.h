@@ -0,0 +1,302 @@
+#ifndef FRAME_BUFFER_H
+#define FRAME_BUFFER_H
+
+// Color buffer the renderer draws into, independent of any window system.
+// Colors are linear floats, one plane per channel, stored in square tiles
+// of pixels rather than in rows, so that the pixels of a small area of the
+// screen share a few cache lines and pages however tall it is. A frame is
+// converted to packed 32 bit pixels in bulk when it is shown, 8 pixels at a
+// time with AVX2 when the CPU has it, 4 at a time with SSE2 on other x86
+// CPUs, and one at a time elsewhere.
+
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+#include "Mesh.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define FRAME_BUFFER_X86
+#endif
+
+const int SRGB_LEVELS = 4096;               // Linear levels of an sRGB table
+
+// Side of a tile in pixels. A row of a tile is one SIMD vector, and a whole
+// tile is 4 cache lines of floats.
+const int BUFFER_TILE = SIMD_WIDTH;
+const int TILE_PIXELS = BUFFER_TILE*BUFFER_TILE;
+
+inline int TileCount( int pixels )
+{
+    return (pixels+BUFFER_TILE-1)/BUFFER_TILE;
+}
+
+// Position of pixel (x,y) in a buffer stored in tiles, tilesX of them to a
+// row of tiles. The tiles follow each other in rows, and the pixels of a
+// tile are in rows as well, so a row of tiles is contiguous.
+inline int TiledIndex( int tilesX, int x, int y )
+{
+    return ((y/BUFFER_TILE)*tilesX + x/BUFFER_TILE)*TILE_PIXELS + (y%BUFFER_TILE)*BUFFER_TILE + x%BUFFER_TILE;
+}
+
+// Position of pixel x of a row relative to pixel 0 of the row.
+inline int TiledRowOffset( int x )
+{
+    return x/BUFFER_TILE*TILE_PIXELS + x%BUFFER_TILE;
+}
+
+struct ColorBuffer
+{
+    int width, height;
+    int tilesX, tilesY;
+    FloatArray r, g, b;
+
+    ColorBuffer()
+        : width(0), height(0), tilesX(0), tilesY(0)
+    {
+    }
+
+    // Makes the buffer width x height pixels and clears it. The tiles past
+    // the right and bottom edges are padded.
+    void Resize( int width, int height )
+    {
+        this->width = width;
+        this->height = height;
+        tilesX = TileCount( width );
+        tilesY = TileCount( height );
+        r.assign( Size(), 0.0f );
+        g.assign( Size(), 0.0f );
+        b.assign( Size(), 0.0f );
+    }
+
+    // Floats in each channel, padding included.
+    int Size() const
+    {
+        return tilesX*tilesY*TILE_PIXELS;
+    }
+
+    int Index( int x, int y ) const
+    {
+        return TiledIndex( tilesX, x, y );
+    }
+
+    // Clears tile (tx,ty), padding included.
+    void ClearTile( int tx, int ty )
+    {
+        int i = (ty*tilesX + tx)*TILE_PIXELS;
+        std::fill( &r[i], &r[i]+TILE_PIXELS, 0.0f );
+        std::fill( &g[i], &g[i]+TILE_PIXELS, 0.0f );
+        std::fill( &b[i], &b[i]+TILE_PIXELS, 0.0f );
+    }
+
+    void Set( int x, int y, const glm::vec3& color )
+    {
+        int i = Index( x, y );
+        r[i] = color.r;
+        g[i] = color.g;
+        b[i] = color.b;
+    }
+};
+
+// Where the 8 bit channels go in a packed 32 bit pixel, and how they are
+// encoded.
+struct PixelLayout
+{
+    int redShift, greenShift, blueShift;
+    uint32_t alpha;                         // Set in every pixel
+    const uint32_t* srgb;                   // See BuildSRGBTable, or 0 for linear
+};
+
+// Fills table with the 8 bit sRGB encoding of SRGB_LEVELS evenly spaced
+// linear values from 0 to 1.
+inline void BuildSRGBTable( uint32_t* table )
+{
+    for( int i=0; i<SRGB_LEVELS; ++i )
+    {
+        float c = i / float(SRGB_LEVELS-1);
+        float s = c <= 0.0031308f ? 12.92f*c : 1.055f*std::pow( c, 1/2.4f ) - 0.055f;
+        table[i] = uint32_t( s*255.0f + 0.5f );
+    }
+}
+
+// Rounds a channel clamped to [0,1] to the nearest of levels, ties to even.
+// Adding 2^23 leaves no bits for a fraction, so the float addition does the
+// rounding.
+inline uint32_t QuantizeChannel( float c, int levels )
+{
+    c = std::max( std::min( c, 1.0f ), 0.0f );
+    return uint32_t( c*float(levels-1) + 8388608.0f ) - 8388608u;
+}
+
+inline uint32_t PackChannel( float c, const PixelLayout& layout )
+{
+    return layout.srgb ? layout.srgb[QuantizeChannel( c, SRGB_LEVELS )] : QuantizeChannel( c, 256 );
+}
+
+// The PackPixels functions convert the pixels [begin,end) of a row, with r,
+// g and b pointing to pixel 0 of the row in a tiled buffer.
+inline void PackPixelsScalar( const float* r, const float* g, const float* b,
+                              const PixelLayout& layout, uint32_t* out, int begin, int end )
+{
+    for( int x=begin; x<end; ++x )
+    {
+        int i = TiledRowOffset( x );
+        out[x] = (PackChannel( r[i], layout ) << layout.redShift) |
+                 (PackChannel( g[i], layout ) << layout.greenShift) |
+                 (PackChannel( b[i], layout ) << layout.blueShift) | layout.alpha;
+    }
+}
+
+#ifdef FRAME_BUFFER_X86
+
+// The vector versions round like the scalar one, since the conversion to
+// integers rounds to nearest even. end-begin must be a multiple of 4 for
+// SSE2 and 8 for AVX2, and a vector that does not start at the beginning of
+// a tile is put together from two loads, one from each tile it touches.
+// They write out with streaming stores, which do not pull the destination
+// into the cache, so out+begin must be aligned to 16 or 32 bytes, and a
+// store fence is needed before anyone else reads the pixels.
+
+// Loads the 4 floats of a tiled row from pixel x on.
+inline __m128 LoadPixelsSSE2( const float* p, int x )
+{
+    int s = x%BUFFER_TILE;
+    __m128 head = _mm_loadu_ps( p+TiledRowOffset( x ) );
+    if( s+4 <= BUFFER_TILE )
+        return head;
+    // The second load ends at the last pixel, so its lanes from the next
+    // tile are in place.
+    __m128 tail = _mm_loadu_ps( p+TiledRowOffset( x+3 )-3 );
+    __m128 next = _mm_castsi128_ps( _mm_cmpgt_epi32( _mm_setr_epi32( 0, 1, 2, 3 ), _mm_set1_epi32( BUFFER_TILE-1-s ) ) );
+    return _mm_or_ps( _mm_and_ps( next, tail ), _mm_andnot_ps( next, head ) );
+}
+
+inline __m128i PackChannelSSE2( __m128 c, const PixelLayout& layout, __m128 scale )
+{
+    c = _mm_max_ps( _mm_min_ps( c, _mm_set1_ps( 1.0f ) ), _mm_setzero_ps() );
+    __m128i level = _mm_cvtps_epi32( _mm_mul_ps( c, scale ) );
+    if( layout.srgb )
+    {
+        // SSE2 has no gather.
+        alignas(16) uint32_t v[4];
+        _mm_store_si128( (__m128i*)v, level );
+        level = _mm_setr_epi32( layout.srgb[v[0]], layout.srgb[v[1]], layout.srgb[v[2]], layout.srgb[v[3]] );
+    }
+    return level;
+}
+
+inline void PackPixelsSSE2( const float* r, const float* g, const float* b,
+                            const PixelLayout& layout, uint32_t* out, int begin, int end )
+{
+    __m128 scale = _mm_set1_ps( layout.srgb ? float(SRGB_LEVELS-1) : 255.0f );
+    __m128i rs = _mm_cvtsi32_si128( layout.redShift );
+    __m128i gs = _mm_cvtsi32_si128( layout.greenShift );
+    __m128i bs = _mm_cvtsi32_si128( layout.blueShift );
+    __m128i alpha = _mm_set1_epi32( int(layout.alpha) );
+    for( int x=begin; x<end; x+=4 )
+    {
+        __m128i p = _mm_or_si128( _mm_or_si128(
+            _mm_sll_epi32( PackChannelSSE2( LoadPixelsSSE2( r, x ), layout, scale ), rs ),
+            _mm_sll_epi32( PackChannelSSE2( LoadPixelsSSE2( g, x ), layout, scale ), gs ) ),
+            _mm_or_si128( _mm_sll_epi32( PackChannelSSE2( LoadPixelsSSE2( b, x ), layout, scale ), bs ), alpha ) );
+        _mm_stream_si128( (__m128i*)(out+x), p );
+    }
+}
+
+// Loads the 8 floats of a tiled row from pixel x on.
+__attribute__((target("avx2")))
+inline __m256 LoadPixelsAVX2( const float* p, int x )
+{
+    int s = x%BUFFER_TILE;
+    if( s == 0 )
+        return _mm256_load_ps( p+TiledRowOffset( x ) );
+    __m256 head = _mm256_loadu_ps( p+TiledRowOffset( x ) );
+    __m256 tail = _mm256_loadu_ps( p+TiledRowOffset( x+7 )-7 );
+    __m256i next = _mm256_cmpgt_epi32( _mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 ), _mm256_set1_epi32( BUFFER_TILE-1-s ) );
+    return _mm256_blendv_ps( head, tail, _mm256_castsi256_ps( next ) );
+}
+
+__attribute__((target("avx2")))
+inline __m256i PackChannelAVX2( __m256 c, const PixelLayout& layout, __m256 scale )
+{
+    c = _mm256_max_ps( _mm256_min_ps( c, _mm256_set1_ps( 1.0f ) ), _mm256_setzero_ps() );
+    __m256i level = _mm256_cvtps_epi32( _mm256_mul_ps( c, scale ) );
+    if( layout.srgb )
+        level = _mm256_i32gather_epi32( (const int*)layout.srgb, level, 4 );
+    return level;
+}
+
+__attribute__((target("avx2")))
+inline void PackPixelsAVX2( const float* r, const float* g, const float* b,
+                            const PixelLayout& layout, uint32_t* out, int begin, int end )
+{
+    __m256 scale = _mm256_set1_ps( layout.srgb ? float(SRGB_LEVELS-1) : 255.0f );
+    __m128i rs = _mm_cvtsi32_si128( layout.redShift );
+    __m128i gs = _mm_cvtsi32_si128( layout.greenShift );
+    __m128i bs = _mm_cvtsi32_si128( layout.blueShift );
+    __m256i alpha = _mm256_set1_epi32( int(layout.alpha) );
+    for( int x=begin; x<end; x+=8 )
+    {
+        __m256i p = _mm256_or_si256( _mm256_or_si256(
+            _mm256_sll_epi32( PackChannelAVX2( LoadPixelsAVX2( r, x ), layout, scale ), rs ),
+            _mm256_sll_epi32( PackChannelAVX2( LoadPixelsAVX2( g, x ), layout, scale ), gs ) ),
+            _mm256_or_si256( _mm256_sll_epi32( PackChannelAVX2( LoadPixelsAVX2( b, x ), layout, scale ), bs ), alpha ) );
+        _mm256_stream_si256( (__m256i*)(out+x), p );
+    }
+}
+
+#endif
+
+// Sets n floats to 0. Where p is aligned to 16 bytes this is done with
+// streaming stores, for memory that is not read again soon, and then
+// StreamFence must be called before the floats are read by another thread.
+inline void StreamZero( float* p, int n )
+{
+#ifdef FRAME_BUFFER_X86
+    int i = 0;
+    if( (uintptr_t)p % 16 == 0 )
+        for( ; i+4<=n; i+=4 )
+            _mm_stream_ps( p+i, _mm_setzero_ps() );
+    std::fill( p+i, p+n, 0.0f );
+#else
+    std::fill( p, p+n, 0.0f );
+#endif
+}
+
+inline void StreamFence()
+{
+#ifdef FRAME_BUFFER_X86
+    _mm_sfence();
+#endif
+}
+
+// Converts row y of the buffer to packed pixels, taking each run of
+// BUFFER_TILE pixels from the tile that holds it. The pixels before the
+// first vector aligned boundary of out, and after the last whole vector,
+// are converted one at a time, and the vectors in between are written with
+// streaming stores.
+inline void PackRow( const ColorBuffer& color, int y, const PixelLayout& layout, uint32_t* out )
+{
+    const float* r = &color.r[color.Index( 0, y )];
+    const float* g = &color.g[color.Index( 0, y )];
+    const float* b = &color.b[color.Index( 0, y )];
+#ifdef FRAME_BUFFER_X86
+    static const bool avx2 = __builtin_cpu_supports( "avx2" );
+    int vector = avx2 ? 8 : 4;
+    int head = int( (uintptr_t)out/4 % vector );
+    head = std::min( head ? vector-head : 0, color.width );
+    int body = head + ((color.width-head) & ~(vector-1));
+    PackPixelsScalar( r, g, b, layout, out, 0, head );
+    if( avx2 )
+        PackPixelsAVX2( r, g, b, layout, out, head, body );
+    else
+        PackPixelsSSE2( r, g, b, layout, out, head, body );
+    _mm_sfence();
+    PackPixelsScalar( r, g, b, layout, out, body, color.width );
+#else
+    PackPixelsScalar( r, g, b, layout, out, 0, color.width );
+#endif
+}
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef HIERARCHICAL_Z_H
+#define HIERARCHICAL_Z_H
+
+// Conservative summary of a depth buffer of 1/z values, where larger means
+// nearer and a fragment passes when its 1/z is larger than the stored one.
+// Level 0 holds the smallest and largest stored 1/z of every HIZ_BLOCK x
+// HIZ_BLOCK block, and each further level combines 2x2 blocks of the one
+// below, up to a single block for the whole buffer. A fragment with 1/z at
+// most the minimum of a block cannot pass anywhere in it, and one above
+// the maximum passes everywhere.
+
+#include <algorithm>
+#include <vector>
+
+const int HIZ_BLOCK = 8;
+
+class HierarchicalZ
+{
+public:
+    HierarchicalZ()
+        : width(0), height(0)
+    {
+    }
+
+    // Covers a buffer of width x height pixels and clears it.
+    void Resize( int width, int height )
+    {
+        this->width = width;
+        this->height = height;
+        levels.clear();
+        int w = (width+HIZ_BLOCK-1)/HIZ_BLOCK;
+        int h = (height+HIZ_BLOCK-1)/HIZ_BLOCK;
+        for( ;; )
+        {
+            Level level;
+            level.width = w;
+            level.height = h;
+            levels.push_back( level );
+            if( w <= 1 && h <= 1 )
+                break;
+            w = (w+1)/2;
+            h = (h+1)/2;
+        }
+        Clear();
+    }
+
+    int Width() const { return width; }
+    int Height() const { return height; }
+
+    // Matches a depth buffer cleared to 0.
+    void Clear()
+    {
+        for( size_t i=0; i<levels.size(); ++i )
+        {
+            levels[i].min.assign( levels[i].width*levels[i].height, 0.0f );
+            levels[i].max.assign( levels[i].width*levels[i].height, 0.0f );
+        }
+    }
+
+    float Min( int bx, int by ) const
+    {
+        return levels[0].min[by*levels[0].width+bx];
+    }
+
+    float Max( int bx, int by ) const
+    {
+        return levels[0].max[by*levels[0].width+bx];
+    }
+
+    // Returns true if no pixel of the rectangle [x0,x1] x [y0,y1] can pass
+    // the depth test with a 1/z of at most zinv. It looks at the coarsest
+    // level where the rectangle overlaps no more than 2x2 blocks.
+    bool Occluded( int x0, int y0, int x1, int y1, float zinv ) const
+    {
+        int level = 0;
+        int size = HIZ_BLOCK;
+        while( level+1 < int(levels.size()) && (x1/size - x0/size > 1 || y1/size - y0/size > 1) )
+        {
+            ++level;
+            size *= 2;
+        }
+
+        const Level& l = levels[level];
+        for( int by=y0/size; by<=y1/size; ++by )
+            for( int bx=x0/size; bx<=x1/size; ++bx )
+                if( zinv > l.min[by*l.width+bx] )
+                    return false;
+        return true;
+    }
+
+    // Records new depth values in level 0 block (bx,by): blockMin is the
+    // smallest 1/z now stored anywhere in the block and written the largest
+    // one just written to it. The change is carried up the levels for as
+    // long as it makes a difference.
+    void Update( int bx, int by, float blockMin, float written )
+    {
+        Level* l = &levels[0];
+        l->min[by*l->width+bx] = blockMin;
+        l->max[by*l->width+bx] = std::max( l->max[by*l->width+bx], written );
+
+        for( size_t i=1; i<levels.size(); ++i )
+        {
+            const Level& child = levels[i-1];
+            int cx = bx & ~1;
+            int cy = by & ~1;
+            float m = child.min[cy*child.width+cx];
+            if( cx+1 < child.width )
+                m = std::min( m, child.min[cy*child.width+cx+1] );
+            if( cy+1 < child.height )
+            {
+                m = std::min( m, child.min[(cy+1)*child.width+cx] );
+                if( cx+1 < child.width )
+                    m = std::min( m, child.min[(cy+1)*child.width+cx+1] );
+            }
+
+            bx /= 2;
+            by /= 2;
+            l = &levels[i];
+            float& parentMin = l->min[by*l->width+bx];
+            float& parentMax = l->max[by*l->width+bx];
+            if( parentMin == m && parentMax >= written )
+                break;
+            parentMin = m;
+            parentMax = std::max( parentMax, written );
+        }
+    }
+
+private:
+    struct Level
+    {
+        int width, height;              // In blocks
+        std::vector<float> min, max;
+    };
+
+    int width, height;
+    std::vector<Level> levels;
+};
+
+#endif
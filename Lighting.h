@@ -0,0 +1,199 @@
+#ifndef LIGHTING_H
+#define LIGHTING_H
+
+// Lighting of fragments stored as structure-of-arrays, as in a G-buffer or
+// a batch of fragments gathered while rasterizing: the diffuse light of a
+// point light plus a constant indirect term, times the color of the
+// surface. It computes what Light() in skeleton.cpp does, 8 fragments at a
+// time with AVX2 when the CPU has it, 4 at a time with SSE2 on other x86
+// CPUs, and one at a time elsewhere. The distance to the light is needed
+// only through one reciprocal square root per fragment, which the vector
+// versions take from the hardware estimate refined by a Newton step.
+
+#include <glm/glm.hpp>
+#include <cmath>
+#include "Mesh.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define LIGHTING_X86
+#endif
+
+struct PointLight
+{
+    glm::vec3 position;
+    glm::vec3 power;
+    glm::vec3 indirect;                     // Power per area, reaches everything
+};
+
+// Surface of each fragment, padded to PaddedSize.
+struct Fragments
+{
+    FloatArray x, y, z;                     // World space position
+    FloatArray nx, ny, nz;                  // Normal
+    FloatArray r, g, b;                     // Color
+
+    void Resize( size_t n )
+    {
+        size_t padded = PaddedSize( n );
+        x.resize( padded );
+        y.resize( padded );
+        z.resize( padded );
+        nx.resize( padded );
+        ny.resize( padded );
+        nz.resize( padded );
+        r.resize( padded );
+        g.resize( padded );
+        b.resize( padded );
+    }
+};
+
+// Surface of up to N fragments, N a multiple of SIMD_WIDTH, in fixed arrays
+// that can live on the stack. LightFragments takes it like Fragments.
+template<int N>
+struct FragmentBatch
+{
+    alignas(SIMD_ALIGN) float x[N], y[N], z[N];
+    alignas(SIMD_ALIGN) float nx[N], ny[N], nz[N];
+    alignas(SIMD_ALIGN) float r[N], g[N], b[N];
+
+    // Sets the fragments from count to the next multiple of SIMD_WIDTH,
+    // which are lit as well, to something harmless.
+    void Pad( int count )
+    {
+        for( int i=count; i<int(PaddedSize( count )); ++i )
+            x[i] = y[i] = z[i] = nx[i] = ny[i] = nz[i] = r[i] = g[i] = b[i] = 0.0f;
+    }
+};
+
+// Lit colors written by LightFragments, starting from the first fragment
+// lit. The arrays must be aligned like a FloatArray.
+struct LitColors
+{
+    float* r;
+    float* g;
+    float* b;
+};
+
+// The light reaching a surface at distance d is power * cos(angle) /
+// (4*pi*d^2), where cos(angle) is dot(r,n)/d, so with inv = 1/d it is
+// power * dot(r,n)*inv^3 / (4*pi).
+
+template<class Surface>
+inline void LightFragmentsScalar( const PointLight& light, const Surface& f,
+                                  int begin, int end, const LitColors& out )
+{
+    for( int i=begin; i<end; ++i )
+    {
+        glm::vec3 r = light.position - glm::vec3( f.x[i], f.y[i], f.z[i] );
+        float inv = 1/std::sqrt( glm::dot( r, r ) );
+        float ratio = glm::dot( r, glm::vec3( f.nx[i], f.ny[i], f.nz[i] ) );
+        ratio = ratio >= 0 ? ratio : 0;
+        float scale = ratio*inv*inv*inv / (4*3.14f);
+        out.r[i-begin] = (light.power.x*scale + light.indirect.x)*f.r[i];
+        out.g[i-begin] = (light.power.y*scale + light.indirect.y)*f.g[i];
+        out.b[i-begin] = (light.power.z*scale + light.indirect.z)*f.b[i];
+    }
+}
+
+#ifdef LIGHTING_X86
+
+template<class Surface>
+inline void LightFragmentsSSE2( const PointLight& light, const Surface& f,
+                                int begin, int end, const LitColors& out )
+{
+    __m128 lx = _mm_set1_ps( light.position.x );
+    __m128 ly = _mm_set1_ps( light.position.y );
+    __m128 lz = _mm_set1_ps( light.position.z );
+    __m128 pr = _mm_set1_ps( light.power.x );
+    __m128 pg = _mm_set1_ps( light.power.y );
+    __m128 pb = _mm_set1_ps( light.power.z );
+    __m128 ir = _mm_set1_ps( light.indirect.x );
+    __m128 ig = _mm_set1_ps( light.indirect.y );
+    __m128 ib = _mm_set1_ps( light.indirect.z );
+    __m128 invSphere = _mm_set1_ps( 1/(4*3.14f) );
+    __m128 half = _mm_set1_ps( 0.5f );
+    __m128 threeHalves = _mm_set1_ps( 1.5f );
+    __m128 zero = _mm_setzero_ps();
+
+    for( int i=begin; i<end; i+=4 )
+    {
+        __m128 dx = _mm_sub_ps( lx, _mm_load_ps( &f.x[i] ) );
+        __m128 dy = _mm_sub_ps( ly, _mm_load_ps( &f.y[i] ) );
+        __m128 dz = _mm_sub_ps( lz, _mm_load_ps( &f.z[i] ) );
+        __m128 squared = _mm_add_ps( _mm_add_ps( _mm_mul_ps( dx, dx ), _mm_mul_ps( dy, dy ) ), _mm_mul_ps( dz, dz ) );
+        __m128 inv = _mm_rsqrt_ps( squared );
+        inv = _mm_mul_ps( inv, _mm_sub_ps( threeHalves, _mm_mul_ps( _mm_mul_ps( half, squared ), _mm_mul_ps( inv, inv ) ) ) );
+        __m128 ratio = _mm_add_ps( _mm_add_ps(
+            _mm_mul_ps( dx, _mm_load_ps( &f.nx[i] ) ),
+            _mm_mul_ps( dy, _mm_load_ps( &f.ny[i] ) ) ),
+            _mm_mul_ps( dz, _mm_load_ps( &f.nz[i] ) ) );
+        ratio = _mm_max_ps( ratio, zero );
+        __m128 scale = _mm_mul_ps( _mm_mul_ps( ratio, invSphere ), _mm_mul_ps( inv, _mm_mul_ps( inv, inv ) ) );
+        _mm_store_ps( &out.r[i-begin], _mm_mul_ps( _mm_add_ps( _mm_mul_ps( pr, scale ), ir ), _mm_load_ps( &f.r[i] ) ) );
+        _mm_store_ps( &out.g[i-begin], _mm_mul_ps( _mm_add_ps( _mm_mul_ps( pg, scale ), ig ), _mm_load_ps( &f.g[i] ) ) );
+        _mm_store_ps( &out.b[i-begin], _mm_mul_ps( _mm_add_ps( _mm_mul_ps( pb, scale ), ib ), _mm_load_ps( &f.b[i] ) ) );
+    }
+}
+
+template<class Surface>
+__attribute__((target("avx2")))
+inline void LightFragmentsAVX2( const PointLight& light, const Surface& f,
+                                int begin, int end, const LitColors& out )
+{
+    __m256 lx = _mm256_set1_ps( light.position.x );
+    __m256 ly = _mm256_set1_ps( light.position.y );
+    __m256 lz = _mm256_set1_ps( light.position.z );
+    __m256 pr = _mm256_set1_ps( light.power.x );
+    __m256 pg = _mm256_set1_ps( light.power.y );
+    __m256 pb = _mm256_set1_ps( light.power.z );
+    __m256 ir = _mm256_set1_ps( light.indirect.x );
+    __m256 ig = _mm256_set1_ps( light.indirect.y );
+    __m256 ib = _mm256_set1_ps( light.indirect.z );
+    __m256 invSphere = _mm256_set1_ps( 1/(4*3.14f) );
+    __m256 half = _mm256_set1_ps( 0.5f );
+    __m256 threeHalves = _mm256_set1_ps( 1.5f );
+    __m256 zero = _mm256_setzero_ps();
+
+    for( int i=begin; i<end; i+=8 )
+    {
+        __m256 dx = _mm256_sub_ps( lx, _mm256_load_ps( &f.x[i] ) );
+        __m256 dy = _mm256_sub_ps( ly, _mm256_load_ps( &f.y[i] ) );
+        __m256 dz = _mm256_sub_ps( lz, _mm256_load_ps( &f.z[i] ) );
+        __m256 squared = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( dx, dx ), _mm256_mul_ps( dy, dy ) ), _mm256_mul_ps( dz, dz ) );
+        __m256 inv = _mm256_rsqrt_ps( squared );
+        inv = _mm256_mul_ps( inv, _mm256_sub_ps( threeHalves, _mm256_mul_ps( _mm256_mul_ps( half, squared ), _mm256_mul_ps( inv, inv ) ) ) );
+        __m256 ratio = _mm256_add_ps( _mm256_add_ps(
+            _mm256_mul_ps( dx, _mm256_load_ps( &f.nx[i] ) ),
+            _mm256_mul_ps( dy, _mm256_load_ps( &f.ny[i] ) ) ),
+            _mm256_mul_ps( dz, _mm256_load_ps( &f.nz[i] ) ) );
+        ratio = _mm256_max_ps( ratio, zero );
+        __m256 scale = _mm256_mul_ps( _mm256_mul_ps( ratio, invSphere ), _mm256_mul_ps( inv, _mm256_mul_ps( inv, inv ) ) );
+        _mm256_store_ps( &out.r[i-begin], _mm256_mul_ps( _mm256_add_ps( _mm256_mul_ps( pr, scale ), ir ), _mm256_load_ps( &f.r[i] ) ) );
+        _mm256_store_ps( &out.g[i-begin], _mm256_mul_ps( _mm256_add_ps( _mm256_mul_ps( pg, scale ), ig ), _mm256_load_ps( &f.g[i] ) ) );
+        _mm256_store_ps( &out.b[i-begin], _mm256_mul_ps( _mm256_add_ps( _mm256_mul_ps( pb, scale ), ib ), _mm256_load_ps( &f.b[i] ) ) );
+    }
+}
+
+#endif
+
+// Lights the fragments [begin,end) of a Fragments or FragmentBatch. Both
+// must be multiples of SIMD_WIDTH, except that end may be the fragment
+// count; the padding is lit as well.
+template<class Surface>
+inline void LightFragments( const PointLight& light, const Surface& f,
+                            int begin, int end, const LitColors& out )
+{
+#ifdef LIGHTING_X86
+    static const bool avx2 = __builtin_cpu_supports( "avx2" );
+    end = int(PaddedSize( end ));
+    if( avx2 )
+        LightFragmentsAVX2( light, f, begin, end, out );
+    else
+        LightFragmentsSSE2( light, f, begin, end, out );
+#else
+    LightFragmentsScalar( light, f, begin, end, out );
+#endif
+}
+
+#endif
@@ -0,0 +1,155 @@
+#ifndef MESH_H
+#define MESH_H
+
+// Indexed triangle mesh. Vertices shared by several triangles are stored
+// once, so they are also transformed once per frame. The positions are kept
+// a second time as separate x, y and z arrays for SIMD vertex processing.
+
+#include <glm/glm.hpp>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <stdint.h>
+#include <vector>
+#include "TestModel.h"
+
+// Widest SIMD vector in floats. Structure-of-arrays data is padded to a
+// multiple of it, so that vector loops need no scalar remainder.
+const int SIMD_WIDTH = 8;
+const size_t SIMD_ALIGN = 64;
+
+inline size_t PaddedSize( size_t n )
+{
+    return (n + SIMD_WIDTH-1) / SIMD_WIDTH * SIMD_WIDTH;
+}
+
+// Standard allocator returning SIMD_ALIGN aligned memory, so that the
+// arrays can be accessed with aligned vector loads and stores.
+template<class T>
+class AlignedAllocator
+{
+public:
+    typedef T value_type;
+
+    AlignedAllocator()
+    {
+    }
+
+    template<class U>
+    AlignedAllocator( const AlignedAllocator<U>& )
+    {
+    }
+
+    T* allocate( size_t n )
+    {
+        // The pointer returned by malloc is kept just before the block.
+        char* raw = (char*)malloc( n*sizeof(T) + SIMD_ALIGN + sizeof(void*) );
+        if( raw == 0 )
+            throw std::bad_alloc();
+        uintptr_t start = (uintptr_t)(raw + sizeof(void*) + SIMD_ALIGN-1) & ~(uintptr_t)(SIMD_ALIGN-1);
+        ((void**)start)[-1] = raw;
+        return (T*)start;
+    }
+
+    void deallocate( T* p, size_t )
+    {
+        free( ((void**)p)[-1] );
+    }
+
+    template<class U>
+    bool operator==( const AlignedAllocator<U>& ) const
+    {
+        return true;
+    }
+
+    template<class U>
+    bool operator!=( const AlignedAllocator<U>& ) const
+    {
+        return false;
+    }
+};
+
+typedef std::vector<float, AlignedAllocator<float> > FloatArray;
+typedef std::vector<int, AlignedAllocator<int> > IntArray;
+
+class Mesh
+{
+public:
+    std::vector<glm::vec3> positions;
+    FloatArray x, y, z;                     // Padded to PaddedSize
+    std::vector<int> indices;               // Three per triangle
+    std::vector<glm::vec3> normals;         // One per triangle
+    std::vector<glm::vec3> colors;          // One per triangle
+
+    int TriangleCount() const
+    {
+        return int(indices.size()/3);
+    }
+
+    int VertexCount() const
+    {
+        return int(positions.size());
+    }
+
+    const glm::vec3& Position( int triangle, int corner ) const
+    {
+        return positions[indices[3*triangle+corner]];
+    }
+};
+
+// Orders positions so that identical ones can be found with a std::map.
+struct PositionLess
+{
+    bool operator()( const glm::vec3& a, const glm::vec3& b ) const
+    {
+        if( a.x != b.x )
+            return a.x < b.x;
+        if( a.y != b.y )
+            return a.y < b.y;
+        return a.z < b.z;
+    }
+};
+
+// Builds an indexed mesh from a triangle list, such as the one from
+// LoadTestModel. Corners with exactly the same position become one vertex.
+void BuildMesh( const std::vector<Triangle>& triangles, Mesh& mesh )
+{
+    mesh.positions.clear();
+    mesh.indices.clear();
+    mesh.normals.clear();
+    mesh.colors.clear();
+    mesh.indices.reserve( 3*triangles.size() );
+    mesh.normals.reserve( triangles.size() );
+    mesh.colors.reserve( triangles.size() );
+
+    std::map<glm::vec3, int, PositionLess> unique;
+    for( size_t i=0; i<triangles.size(); ++i )
+    {
+        const glm::vec3* corners[3] = { &triangles[i].v0, &triangles[i].v1, &triangles[i].v2 };
+        for( int j=0; j<3; ++j )
+        {
+            std::map<glm::vec3, int, PositionLess>::iterator it = unique.find( *corners[j] );
+            if( it == unique.end() )
+            {
+                it = unique.insert( std::make_pair( *corners[j], int(mesh.positions.size()) ) ).first;
+                mesh.positions.push_back( *corners[j] );
+            }
+            mesh.indices.push_back( it->second );
+        }
+        mesh.normals.push_back( triangles[i].normal );
+        mesh.colors.push_back( triangles[i].color );
+    }
+
+    size_t padded = PaddedSize( mesh.positions.size() );
+    mesh.x.assign( padded, 0 );
+    mesh.y.assign( padded, 0 );
+    mesh.z.assign( padded, 0 );
+    for( size_t i=0; i<mesh.positions.size(); ++i )
+    {
+        mesh.x[i] = mesh.positions[i].x;
+        mesh.y[i] = mesh.positions[i].y;
+        mesh.z[i] = mesh.positions[i].z;
+    }
+}
+
+#endif
@@ -0,0 +1,243 @@
+#ifndef OCCLUSION_H
+#define OCCLUSION_H
+
+// Object level occlusion culling. A few large triangles, the occluders, are
+// drawn into a small depth buffer of 1/z values at a fraction of the screen
+// resolution. It is conservative: a cell only gets a depth once occluders
+// cover all of it, and then the farthest depth of those occluders over the
+// cell. Anything whose nearest point is behind the stored depth of every
+// cell it overlaps is hidden and need not be drawn.
+//
+// Occluders are rasterized the way RasterizeTriangle does it, from vertices
+// rounded to subpixels and with the same edge functions and fill rule, so
+// their coverage is exactly that of the rendered triangles. It is tracked
+// per screen pixel with a bit mask in every cell, so that cells split
+// between occluders, such as those along the diagonal of a quad, are filled
+// as well.
+
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+#include <vector>
+#include "Mesh.h"
+#include "VertexStage.h"
+#include "RasterRow.h"
+
+const float OCCLUSION_SLACK = 1e-3f;    // Relative, for the rounding of the renderer
+
+class OcclusionBuffer
+{
+public:
+    // Covers a screen of width x height pixels with cells of scale x scale
+    // pixels, where scale is at most 8. nearPlane is the camera space z
+    // below which nothing is drawn.
+    void Resize( int width, int height, int scale, float nearPlane )
+    {
+        this->scale = scale;
+        this->nearPlane = nearPlane;
+        cellsX = (width+scale-1)/scale;
+        cellsY = (height+scale-1)/scale;
+        full = scale*scale == 64 ? ~uint64_t(0) : (uint64_t(1) << scale*scale)-1;
+        cells.resize( cellsX*cellsY );
+        Clear();
+    }
+
+    void Clear()
+    {
+        Cell empty = { 0.0f, 0.0f, 0 };
+        std::fill( cells.begin(), cells.end(), empty );
+    }
+
+    // Draws a world space triangle that faces the camera. Triangles that
+    // the renderer would clip, being outside one of the clip planes of t,
+    // are left out.
+    void DrawOccluder( const VertexTransform& t, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c )
+    {
+        int x[3], y[3];
+        float z[3];
+        if( !ProjectUnclipped( t, a, x[0], y[0], z[0] ) ||
+            !ProjectUnclipped( t, b, x[1], y[1], z[1] ) ||
+            !ProjectUnclipped( t, c, x[2], y[2], z[2] ) )
+            return;
+
+        EdgeFunction edge[3];
+        int64_t area = SetupEdges( x, y, edge );
+        if( area == 0 )
+            return;
+
+        // The plane of 1/z, through the vertex 0.
+        glm::vec3 zinv( 0.0f );
+        for( int i=0; i<3; ++i )
+        {
+            zinv.x += float( edge[i].a/double(area) )*z[i];
+            zinv.y += float( edge[i].b/double(area) )*z[i];
+        }
+        zinv.z = z[0] - zinv.x*float(x[0])/SUBPIXELS - zinv.y*float(y[0])/SUBPIXELS;
+
+        int minX = PixelCeil( std::min( x[0], std::min( x[1], x[2] ) ) );
+        int minY = PixelCeil( std::min( y[0], std::min( y[1], y[2] ) ) );
+        int maxX = PixelFloor( std::max( x[0], std::max( x[1], x[2] ) ) );
+        int maxY = PixelFloor( std::max( y[0], std::max( y[1], y[2] ) ) );
+        if( minX > maxX || minY > maxY || maxX < 0 || maxY < 0 )
+            return;
+        minX = std::max( minX, 0 )/scale;
+        minY = std::max( minY, 0 )/scale;
+        maxX = std::min( maxX/scale, cellsX-1 );
+        maxY = std::min( maxY/scale, cellsY-1 );
+
+        for( int y=minY; y<=maxY; ++y )
+        {
+            for( int x=minX; x<=maxX; ++x )
+            {
+                uint64_t mask = 0;
+                for( int j=0; j<scale; ++j )
+                {
+                    int py = y*scale+j;
+                    for( int i=0; i<scale; ++i )
+                    {
+                        int px = x*scale+i;
+                        if( EdgeValue( edge[0], px, py ) >= 0 &&
+                            EdgeValue( edge[1], px, py ) >= 0 &&
+                            EdgeValue( edge[2], px, py ) >= 0 )
+                            mask |= uint64_t(1) << (j*scale+i);
+                    }
+                }
+                if( mask == 0 )
+                    continue;
+
+                float x0 = float(x*scale), y0 = float(y*scale);
+                float z = PlaneMin( zinv, x0, y0, x0+scale-1, y0+scale-1 )*(1-OCCLUSION_SLACK);
+                Add( cells[y*cellsX+x], mask, z );
+            }
+        }
+    }
+
+    // Returns true if the world space box is hidden behind the occluders.
+    bool Occluded( const VertexTransform& t, const glm::vec3& min, const glm::vec3& max ) const
+    {
+        float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f;
+        float maxZinv = 0;
+        for( int i=0; i<8; ++i )
+        {
+            glm::vec3 corner( i&1 ? max.x : min.x, i&2 ? max.y : min.y, i&4 ? max.z : min.z );
+            glm::vec3 p;
+            if( !Project( t, corner, p ) )
+                return false;
+            minX = std::min( minX, p.x );
+            minY = std::min( minY, p.y );
+            maxX = std::max( maxX, p.x );
+            maxY = std::max( maxY, p.y );
+            maxZinv = std::max( maxZinv, p.z );
+        }
+
+        // Grown by a pixel for the renderer rounding vertices.
+        int x0 = std::max( int(std::floor( minX-1 ))/scale, 0 );
+        int y0 = std::max( int(std::floor( minY-1 ))/scale, 0 );
+        int x1 = std::min( int(std::floor( maxX+1 ))/scale, cellsX-1 );
+        int y1 = std::min( int(std::floor( maxY+1 ))/scale, cellsY-1 );
+        if( x0 > x1 || y0 > y1 )
+            return false;
+
+        maxZinv *= 1+OCCLUSION_SLACK;
+        for( int y=y0; y<=y1; ++y )
+            for( int x=x0; x<=x1; ++x )
+                if( cells[y*cellsX+x].depth <= maxZinv )
+                    return false;
+        return true;
+    }
+
+private:
+    struct Cell
+    {
+        float depth;                    // Of occluders covering the whole cell
+        float partialDepth;             // Of occluders covering partialMask
+        uint64_t partialMask;
+    };
+
+    // Merges an occluder covering the pixels in mask with 1/z of at least z.
+    // Partial coverage is gathered until the cell is full, which makes the
+    // farthest of the gathered depths valid for the whole cell.
+    void Add( Cell& cell, uint64_t mask, float z )
+    {
+        if( mask == full )
+        {
+            cell.depth = std::max( cell.depth, z );
+            return;
+        }
+        cell.partialDepth = cell.partialMask ? std::min( cell.partialDepth, z ) : z;
+        cell.partialMask |= mask;
+        if( cell.partialMask == full )
+        {
+            cell.depth = std::max( cell.depth, cell.partialDepth );
+            cell.partialMask = 0;
+        }
+    }
+
+    // Projects a world space point to screen pixels and 1/z. Returns false
+    // if the point is in front of the near plane.
+    bool Project( const VertexTransform& t, const glm::vec3& world, glm::vec3& p ) const
+    {
+        glm::vec3 local = (world-t.position)*t.rot;
+        if( local.z < nearPlane )
+            return false;
+        float zinv = 1/local.z;
+        p.x = t.focal*local.x*zinv + t.centerX;
+        p.y = t.focal*local.y*zinv + t.centerY;
+        p.z = zinv;
+        return true;
+    }
+
+    // Projects a vertex like the vertex stage does, to subpixels and 1/z.
+    // Returns false if it needs clipping.
+    bool ProjectUnclipped( const VertexTransform& t, const glm::vec3& world, int& x, int& y, float& z ) const
+    {
+        glm::vec3 local = (world-t.position)*t.rot;
+        for( int i=0; i<t.planes; ++i )
+            if( glm::dot( glm::vec3(t.clip[i]), local ) + t.clip[i].w < 0 )
+                return false;
+        z = 1/local.z;
+        x = ToSubpixels( (t.focal * local.x * z) + t.centerX );
+        y = ToSubpixels( (t.focal * local.y * z) + t.centerY );
+        return true;
+    }
+
+    static float PlaneMin( const glm::vec3& q, float x0, float y0, float x1, float y1 )
+    {
+        return q.x*(q.x > 0 ? x0 : x1) + q.y*(q.y > 0 ? y0 : y1) + q.z;
+    }
+
+    int scale;
+    float nearPlane;
+    int cellsX, cellsY;
+    uint64_t full;                      // Mask of all pixels of a cell
+    std::vector<Cell> cells;
+};
+
+// Picks the triangles of the mesh whose area is at least the given fraction
+// of the squared diagonal of the mesh bounds, such as the walls of a room.
+inline void SelectOccluders( const Mesh& mesh, float fraction, std::vector<int>& occluders )
+{
+    occluders.clear();
+    if( mesh.positions.empty() )
+        return;
+
+    glm::vec3 lo = mesh.positions[0], hi = mesh.positions[0];
+    for( size_t i=1; i<mesh.positions.size(); ++i )
+    {
+        lo = glm::min( lo, mesh.positions[i] );
+        hi = glm::max( hi, mesh.positions[i] );
+    }
+    glm::vec3 diagonal = hi-lo;
+    float minArea = fraction*glm::dot( diagonal, diagonal );
+
+    for( int i=0; i<mesh.TriangleCount(); ++i )
+    {
+        glm::vec3 e1 = mesh.Position( i, 1 )-mesh.Position( i, 0 );
+        glm::vec3 e2 = mesh.Position( i, 2 )-mesh.Position( i, 0 );
+        if( 0.5f*glm::length( glm::cross( e1, e2 ) ) >= minArea )
+            occluders.push_back( i );
+    }
+}
+
+#endif
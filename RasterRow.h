@@ -0,0 +1,278 @@
+#ifndef RASTER_ROW_H
+#define RASTER_ROW_H
+
+// Coverage and depth test of a triangle over a row of RASTER_ROW pixels,
+// such as a row of a tile of a tiled buffer. The three edge functions and
+// 1/z are evaluated at every pixel from their values at the first pixel of
+// the row, the pixels inside all edges are depth tested, and the depth of
+// those that pass is written. This is done for the whole row at once with
+// AVX2 when the CPU has it, as two halves with SSE2 on other x86 CPUs, and
+// one pixel at a time elsewhere. The edge functions are stepped in integers
+// and 1/z with the same float operations in all three, so they cover the
+// same pixels and write the same depths.
+
+#include <algorithm>
+#include <stdint.h>
+#include "Mesh.h"
+#include "VertexStage.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define RASTER_ROW_X86
+#endif
+
+const int RASTER_ROW = SIMD_WIDTH;
+
+// Edge function of a triangle, a*x + b*y + c at pixel (x,y), in squared
+// subpixels. It is non-negative at the pixels the triangle covers.
+struct EdgeFunction
+{
+    int a, b;
+    int64_t c;
+};
+
+// Sets up the edge functions of the triangle with vertices (x[i],y[i]) in
+// subpixels, edge i being opposite to vertex i, so that the inside is
+// positive for both windings. A pixel exactly on an edge is covered only if
+// that is a top or a left edge of the triangle. The two triangles sharing
+// an edge see it from opposite sides, so exactly one of them covers such a
+// pixel. Returns twice the area in squared subpixels, or 0 if the triangle
+// is degenerate.
+inline int64_t SetupEdges( const int* x, const int* y, EdgeFunction* edge )
+{
+    int64_t area = int64_t(x[1]-x[0])*(y[2]-y[0]) - int64_t(y[1]-y[0])*(x[2]-x[0]);
+    if( area == 0 )
+        return 0;
+    int sign = area > 0 ? 1 : -1;
+    for( int i=0; i<3; ++i )
+    {
+        int u = (i+1)%3;
+        int v = (i+2)%3;
+        int a = sign*(y[u]-y[v]);
+        int b = sign*(x[v]-x[u]);
+        edge[i].a = a*SUBPIXELS;
+        edge[i].b = b*SUBPIXELS;
+        edge[i].c = sign*(int64_t(x[u])*y[v] - int64_t(y[u])*x[v]);
+
+        // The inside is right of a left edge and below a top edge.
+        if( !(a > 0 || (a == 0 && b > 0)) )
+            edge[i].c -= 1;
+    }
+    return sign*area;
+}
+
+inline int64_t EdgeValue( const EdgeFunction& e, int x, int y )
+{
+    return int64_t(e.a)*x + int64_t(e.b)*y + e.c;
+}
+
+// Largest value of an edge function over the rectangle [x0,x1] x [y0,y1].
+inline int64_t EdgeMax( const EdgeFunction& e, int x0, int y0, int x1, int y1 )
+{
+    return EdgeValue( e, e.a > 0 ? x1 : x0, e.b > 0 ? y1 : y0 );
+}
+
+// Value of an edge function at pixel (x,y), the first of a row. Far from
+// the edge only its sign matters, so it is clamped to where stepping along
+// the row neither overflows nor changes it.
+inline int RowEdge( const EdgeFunction& e, int x, int y )
+{
+    const int64_t limit = int64_t(1) << 30;
+    return int( std::max( std::min( EdgeValue( e, x, y ), limit ), -limit ) );
+}
+
+// Planes of a triangle at the first pixel of a row, and their change from
+// one pixel to the next.
+struct RasterRowPlanes
+{
+    int edge[3];                            // See RowEdge
+    int edgeStep[3];
+    float zinv;
+    float zinvStep;
+};
+
+// What a pixel inside the triangle must do to pass. With DEPTH_EQUAL the
+// depth of a passing pixel is negated, so that it does not pass again.
+enum DepthTest
+{
+    DEPTH_ALWAYS,
+    DEPTH_GREATER,
+    DEPTH_EQUAL
+};
+
+struct RasterRowResult
+{
+    int passed;                             // Bit i set: pixel i passed
+    int tested;                             // Pixels inside the triangle
+    int failed;                             // Of those, pixels that did not pass
+    float written;                          // Largest 1/z written, or 0
+};
+
+// 1/z of pixel i of the row, as RasterRow computes it.
+inline float RasterRowZinv( const RasterRowPlanes& p, int i )
+{
+    return p.zinv + float(i)*p.zinvStep;
+}
+
+inline RasterRowResult RasterRowScalar( const RasterRowPlanes& p, int first, int last,
+                                        DepthTest test, float* depth, int* ids, int id )
+{
+    RasterRowResult r = { 0, 0, 0, 0.0f };
+    for( int i=first; i<=last; ++i )
+    {
+        if( p.edge[0] + i*p.edgeStep[0] >= 0 &&
+            p.edge[1] + i*p.edgeStep[1] >= 0 &&
+            p.edge[2] + i*p.edgeStep[2] >= 0 )
+        {
+            ++r.tested;
+            float zinv = p.zinv + float(i)*p.zinvStep;
+            if( test == DEPTH_ALWAYS || (test == DEPTH_GREATER ? zinv > depth[i] : zinv == depth[i]) )
+            {
+                depth[i] = test == DEPTH_EQUAL ? -zinv : zinv;
+                if( ids )
+                    ids[i] = id;
+                r.passed |= 1 << i;
+                r.written = std::max( r.written, zinv );
+            }
+            else
+                ++r.failed;
+        }
+    }
+    return r;
+}
+
+#ifdef RASTER_ROW_X86
+
+// The vector versions load and store the whole row, which must be aligned
+// like a FloatArray, and blend the new depths and ids into it.
+
+inline RasterRowResult RasterRowSSE2( const RasterRowPlanes& p, int first, int last,
+                                      DepthTest test, float* depth, int* ids, int id )
+{
+    RasterRowResult r = { 0, 0, 0, 0.0f };
+    __m128 written = _mm_setzero_ps();
+    __m128i minusOne = _mm_set1_epi32( -1 );
+    for( int half=0; half<2; ++half )
+    {
+        __m128 x = _mm_setr_ps( float(4*half), float(4*half+1), float(4*half+2), float(4*half+3) );
+        __m128 inside = _mm_and_ps( _mm_cmpge_ps( x, _mm_set1_ps( float(first) ) ),
+                                    _mm_cmple_ps( x, _mm_set1_ps( float(last) ) ) );
+        for( int k=0; k<3; ++k )
+        {
+            // SSE2 cannot multiply 32 bit integers, so the steps are added.
+            int step = p.edgeStep[k];
+            __m128i e = _mm_add_epi32( _mm_set1_epi32( p.edge[k] + 4*half*step ),
+                                       _mm_setr_epi32( 0, step, 2*step, 3*step ) );
+            inside = _mm_and_ps( inside, _mm_castsi128_ps( _mm_cmpgt_epi32( e, minusOne ) ) );
+        }
+        int covered = _mm_movemask_ps( inside );
+        if( covered == 0 )
+            continue;
+
+        __m128 zinv = _mm_add_ps( _mm_set1_ps( p.zinv ), _mm_mul_ps( x, _mm_set1_ps( p.zinvStep ) ) );
+        __m128 stored = _mm_load_ps( depth+4*half );
+        __m128 pass = inside;
+        if( test == DEPTH_GREATER )
+            pass = _mm_and_ps( pass, _mm_cmpgt_ps( zinv, stored ) );
+        else if( test == DEPTH_EQUAL )
+            pass = _mm_and_ps( pass, _mm_cmpeq_ps( zinv, stored ) );
+        int passed = _mm_movemask_ps( pass );
+        r.tested += __builtin_popcount( covered );
+        r.failed += __builtin_popcount( covered & ~passed );
+        if( passed == 0 )
+            continue;
+
+        __m128 value = test == DEPTH_EQUAL ? _mm_xor_ps( zinv, _mm_set1_ps( -0.0f ) ) : zinv;
+        _mm_store_ps( depth+4*half, _mm_or_ps( _mm_and_ps( pass, value ), _mm_andnot_ps( pass, stored ) ) );
+        if( ids )
+        {
+            __m128i mask = _mm_castps_si128( pass );
+            __m128i old = _mm_load_si128( (__m128i*)(ids+4*half) );
+            _mm_store_si128( (__m128i*)(ids+4*half),
+                _mm_or_si128( _mm_and_si128( mask, _mm_set1_epi32( id ) ), _mm_andnot_si128( mask, old ) ) );
+        }
+        r.passed |= passed << 4*half;
+        written = _mm_max_ps( written, _mm_and_ps( pass, zinv ) );
+    }
+    written = _mm_max_ps( written, _mm_shuffle_ps( written, written, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+    written = _mm_max_ps( written, _mm_shuffle_ps( written, written, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+    r.written = _mm_cvtss_f32( written );
+    return r;
+}
+
+__attribute__((target("avx2")))
+inline RasterRowResult RasterRowAVX2( const RasterRowPlanes& p, int first, int last,
+                                      DepthTest test, float* depth, int* ids, int id )
+{
+    RasterRowResult r = { 0, 0, 0, 0.0f };
+    __m256 x = _mm256_setr_ps( 0, 1, 2, 3, 4, 5, 6, 7 );
+    __m256i xi = _mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 );
+    __m256i minusOne = _mm256_set1_epi32( -1 );
+    __m256 inside = _mm256_and_ps( _mm256_cmp_ps( x, _mm256_set1_ps( float(first) ), _CMP_GE_OQ ),
+                                   _mm256_cmp_ps( x, _mm256_set1_ps( float(last) ), _CMP_LE_OQ ) );
+    for( int k=0; k<3; ++k )
+    {
+        __m256i e = _mm256_add_epi32( _mm256_set1_epi32( p.edge[k] ), _mm256_mullo_epi32( xi, _mm256_set1_epi32( p.edgeStep[k] ) ) );
+        inside = _mm256_and_ps( inside, _mm256_castsi256_ps( _mm256_cmpgt_epi32( e, minusOne ) ) );
+    }
+    int covered = _mm256_movemask_ps( inside );
+    if( covered == 0 )
+        return r;
+
+    __m256 zinv = _mm256_add_ps( _mm256_set1_ps( p.zinv ), _mm256_mul_ps( x, _mm256_set1_ps( p.zinvStep ) ) );
+    __m256 stored = _mm256_load_ps( depth );
+    __m256 pass = inside;
+    if( test == DEPTH_GREATER )
+        pass = _mm256_and_ps( pass, _mm256_cmp_ps( zinv, stored, _CMP_GT_OQ ) );
+    else if( test == DEPTH_EQUAL )
+        pass = _mm256_and_ps( pass, _mm256_cmp_ps( zinv, stored, _CMP_EQ_OQ ) );
+    r.passed = _mm256_movemask_ps( pass );
+    r.tested = __builtin_popcount( covered );
+    r.failed = __builtin_popcount( covered & ~r.passed );
+    if( r.passed == 0 )
+        return r;
+
+    __m256 value = test == DEPTH_EQUAL ? _mm256_xor_ps( zinv, _mm256_set1_ps( -0.0f ) ) : zinv;
+    _mm256_store_ps( depth, _mm256_blendv_ps( stored, value, pass ) );
+    if( ids )
+    {
+        __m256i old = _mm256_load_si256( (__m256i*)ids );
+        _mm256_store_si256( (__m256i*)ids, _mm256_blendv_epi8( old, _mm256_set1_epi32( id ), _mm256_castps_si256( pass ) ) );
+    }
+    __m256 written = _mm256_and_ps( pass, zinv );
+    __m128 half = _mm_max_ps( _mm256_castps256_ps128( written ), _mm256_extractf128_ps( written, 1 ) );
+    half = _mm_max_ps( half, _mm_shuffle_ps( half, half, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+    half = _mm_max_ps( half, _mm_shuffle_ps( half, half, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+    r.written = _mm_cvtss_f32( half );
+    return r;
+}
+
+#endif
+
+// Names the code path RasterRow takes on this CPU.
+inline const char* RasterRowISA()
+{
+#ifdef RASTER_ROW_X86
+    static const bool avx2 = __builtin_cpu_supports( "avx2" );
+    return avx2 ? "avx2" : "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+// Rasterizes the pixels [first,last] of a row into depth and, if given, the
+// triangle id into ids, both holding RASTER_ROW entries.
+inline RasterRowResult RasterRow( const RasterRowPlanes& p, int first, int last,
+                                  DepthTest test, float* depth, int* ids, int id )
+{
+#ifdef RASTER_ROW_X86
+    static const bool avx2 = __builtin_cpu_supports( "avx2" );
+    if( avx2 )
+        return RasterRowAVX2( p, first, last, test, depth, ids, id );
+    return RasterRowSSE2( p, first, last, test, depth, ids, id );
+#else
+    return RasterRowScalar( p, first, last, test, depth, ids, id );
+#endif
+}
+
+#endif
@@ -6,6 +6,7 @@
 #include "SDL.h"
 #include <iostream>
 #include <glm/glm.hpp>
+#include "FrameBuffer.h"
 
 // Initializes SDL (video and timer). SDL creates a window where you can draw.
 // A pointer to this SDL_Surface is returned. After calling this function
@@ -27,6 +28,14 @@ bool NoQuitMessageSDL();
 // SDL_UpdateRect( surface, 0, 0, 0, 0 );
 void PutPixelSDL( SDL_Surface* surface, int x, int y, glm::vec3 color );
 
+// Converts a color to the pixel format of the surface, as PutPixelSDL does,
+// for code that writes to surface->pixels (or a copy of it) directly.
+Uint32 MapColorSDL( SDL_Surface* surface, glm::vec3 color );
+
+// Returns where the channels go in the pixels of a 32 bit surface, such as
+// the one InitializeSDL creates. The channels are linear.
+PixelLayout PixelLayoutSDL( SDL_Surface* surface );
+
 SDL_Surface* InitializeSDL( int width, int height, bool fullscreen )
 {
 	if( SDL_Init( SDL_INIT_VIDEO | SDL_INIT_TIMER ) < 0 )
@@ -78,6 +87,12 @@ void PutPixelSDL( SDL_Surface* surface, int x, int y, glm::vec3 color )
 	if( x < 0 || surface->w <= x || y < 0 || surface->h <= y )
 		return;
 
+	Uint32* p = (Uint32*)surface->pixels + y*surface->pitch/4 + x;
+	*p = MapColorSDL( surface, color );
+}
+
+Uint32 MapColorSDL( SDL_Surface* surface, glm::vec3 color )
+{
 	//Uint8 r = Uint8( glm::clamp( 255*color.r, 0.f, 255.f ) );
 	//Uint8 g = Uint8( glm::clamp( 255*color.g, 0.f, 255.f ) );
 	//Uint8 b = Uint8( glm::clamp( 255*color.b, 0.f, 255.f ) );
@@ -90,8 +105,18 @@ void PutPixelSDL( SDL_Surface* surface, int x, int y, glm::vec3 color )
 	Uint8 g = u8fromfloat_trick( glm::min( color.g, 1.f ) );
 	Uint8 b = u8fromfloat_trick( glm::min( color.b, 1.f ) );
 
-	Uint32* p = (Uint32*)surface->pixels + y*surface->pitch/4 + x;
-	*p = SDL_MapRGB( surface->format, r, g, b );
+	return SDL_MapRGB( surface->format, r, g, b );
+}
+
+PixelLayout PixelLayoutSDL( SDL_Surface* surface )
+{
+	PixelLayout layout;
+	layout.redShift = surface->format->Rshift;
+	layout.greenShift = surface->format->Gshift;
+	layout.blueShift = surface->format->Bshift;
+	layout.alpha = surface->format->Amask;
+	layout.srgb = 0;
+	return layout;
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,393 @@
+#ifndef SETUP_STAGE_H
+#define SETUP_STAGE_H
+
+// Triangle setup for the edge function rasterizers, in groups of
+// SETUP_GROUP triangles. The triangles of a group are culled, their
+// projected vertices are fetched from the output of the vertex stage, and
+// the edge functions, bounding boxes and attribute planes are computed for
+// all of them at once. Only the triangles that are left are written out,
+// one after another. This is done 8 triangles at a time with AVX2 when the
+// CPU has it, and one at a time elsewhere, as SSE2 lacks the gathers and
+// integer multiplies it takes. Triangles that need clipping are left to the
+// caller.
+
+#include <glm/glm.hpp>
+#include <stdint.h>
+#include "Mesh.h"
+#include "VertexStage.h"
+#include "RasterRow.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SETUP_STAGE_X86
+#endif
+
+const int SETUP_GROUP = SIMD_WIDTH;
+
+// Per-triangle state for the half-space rasterizer. Every quantity is an
+// affine function of the screen position, q(x,y) = a*x + b*y + c, so it can
+// be stepped with additions while traversing the bounding box.
+struct TriangleSetup
+{
+    int minX, minY, maxX, maxY;     // Screen bounding box, inclusive
+    EdgeFunction edge[3];           // >= 0 inside, see SetupEdges
+    glm::vec3 zinv;                 // Plane of 1/z
+    glm::vec3 posA, posB, posC;     // Plane of pos3d/z, one vec3 per coefficient
+    glm::vec3 color;
+    glm::vec3 normal;
+    int id;                         // Set by the caller
+};
+
+// What SetupTriangles needs besides the mesh and its vertices.
+struct SetupView
+{
+    glm::vec3 camera;               // World space position
+    int width, height;              // Of the screen
+    bool cull;                      // Cull back-facing and outside triangles
+};
+
+// What became of each triangle of a group, bit i for triangle i.
+struct SetupMasks
+{
+    int drawn;                      // Written out
+    int clip;                       // Needs clipping
+    int backFacing;
+    int outside;                    // Of the frustum
+};
+
+// Number of triangles in one of the SetupMasks.
+inline int MaskCount( int mask )
+{
+#ifdef __GNUC__
+    return __builtin_popcount( mask );
+#else
+    int n = 0;
+    for( ; mask; mask &= mask-1 )
+        ++n;
+    return n;
+#endif
+}
+
+// Computes the edge functions and attribute planes of a screen space
+// triangle from its vertices in subpixels, their 1/z and their world space
+// positions times 1/z. Returns false if the triangle is degenerate or
+// covers no pixel on the screen.
+inline bool SetupScreenTriangle( const int* x, const int* y, const float* zinv, const glm::vec3* pos,
+                                 int width, int height, TriangleSetup& s )
+{
+    int64_t area = SetupEdges( x, y, s.edge );
+    if( area == 0 )
+        return false;
+
+    s.minX = std::max( PixelCeil( std::min( x[0], std::min( x[1], x[2] ) ) ), 0 );
+    s.minY = std::max( PixelCeil( std::min( y[0], std::min( y[1], y[2] ) ) ), 0 );
+    s.maxX = std::min( PixelFloor( std::max( x[0], std::max( x[1], x[2] ) ) ), width-1 );
+    s.maxY = std::min( PixelFloor( std::max( y[0], std::max( y[1], y[2] ) ) ), height-1 );
+    if( s.minX > s.maxX || s.minY > s.maxY )
+        return false;
+
+    // Edge i is opposite to vertex i, so normalized by the area it is the
+    // barycentric weight of that vertex, and its steps give the change of
+    // each interpolated quantity per pixel. The planes pass through the
+    // quantities at vertex 0.
+    float wx[3], wy[3];
+    for( int i=0; i<3; ++i )
+    {
+        wx[i] = float( s.edge[i].a/double(area) );
+        wy[i] = float( s.edge[i].b/double(area) );
+    }
+    float x0 = float(x[0])/SUBPIXELS;
+    float y0 = float(y[0])/SUBPIXELS;
+
+    s.zinv.x = wx[0]*zinv[0] + wx[1]*zinv[1] + wx[2]*zinv[2];
+    s.zinv.y = wy[0]*zinv[0] + wy[1]*zinv[1] + wy[2]*zinv[2];
+    s.zinv.z = zinv[0] - s.zinv.x*x0 - s.zinv.y*y0;
+
+    s.posA = wx[0]*pos[0] + wx[1]*pos[1] + wx[2]*pos[2];
+    s.posB = wy[0]*pos[0] + wy[1]*pos[1] + wy[2]*pos[2];
+    s.posC = pos[0] - s.posA*x0 - s.posB*y0;
+    return true;
+}
+
+// The SetupTriangles functions set up the triangles[0,count) of the mesh,
+// count at most SETUP_GROUP, and write those that are drawn to out in their
+// order.
+
+inline SetupMasks SetupTrianglesScalar( const Mesh& mesh, const ShadedVertices& shaded, const SetupView& view,
+                                        const int* triangles, int count, TriangleSetup* out )
+{
+    SetupMasks m = { 0, 0, 0, 0 };
+    int n = 0;
+    for( int i=0; i<count; ++i )
+    {
+        int t = triangles[i];
+        const int* v = &mesh.indices[3*t];
+        if( view.cull )
+        {
+            // The normals of the model point to the side the surface is seen from.
+            if( glm::dot( mesh.normals[t], view.camera-mesh.positions[v[0]] ) <= 0 )
+            {
+                m.backFacing |= 1 << i;
+                continue;
+            }
+            if( shaded.outside[v[0]] & shaded.outside[v[1]] & shaded.outside[v[2]] )
+            {
+                m.outside |= 1 << i;
+                continue;
+            }
+        }
+        if( shaded.clip[v[0]] | shaded.clip[v[1]] | shaded.clip[v[2]] )
+        {
+            m.clip |= 1 << i;
+            continue;
+        }
+
+        int x[3], y[3];
+        float zinv[3];
+        glm::vec3 pos[3];
+        for( int k=0; k<3; ++k )
+        {
+            x[k] = shaded.x[v[k]];
+            y[k] = shaded.y[v[k]];
+            zinv[k] = shaded.zinv[v[k]];
+            pos[k] = mesh.positions[v[k]]*zinv[k];
+        }
+        TriangleSetup& s = out[n];
+        if( !SetupScreenTriangle( x, y, zinv, pos, view.width, view.height, s ) )
+            continue;
+        s.color = mesh.colors[t];
+        s.normal = mesh.normals[t];
+        m.drawn |= 1 << i;
+        ++n;
+    }
+    return m;
+}
+
+#ifdef SETUP_STAGE_X86
+
+// The vector version evaluates the expressions of the scalar one in the
+// same order and without fused multiply-adds, so both give the same setups
+// bit for bit. The products of the edge functions and the area do not fit
+// in 32 bits, so they are computed in doubles, four triangles at a time,
+// where they are exact.
+
+// Half h of 8 integers, as doubles.
+__attribute__((target("avx2")))
+inline __m256d SetupHalf( __m256i v, int h )
+{
+    return _mm256_cvtepi32_pd( h ? _mm256_extracti128_si256( v, 1 ) : _mm256_castsi256_si128( v ) );
+}
+
+// Mask of the lanes whose bit is set in bits.
+__attribute__((target("avx2")))
+inline __m256i SetupLanes( int bits )
+{
+    __m256i lane = _mm256_setr_epi32( 1, 2, 4, 8, 16, 32, 64, 128 );
+    return _mm256_cmpeq_epi32( _mm256_and_si256( _mm256_set1_epi32( bits ), lane ), lane );
+}
+
+__attribute__((target("avx2")))
+inline SetupMasks SetupTrianglesAVX2( const Mesh& mesh, const ShadedVertices& shaded, const SetupView& view,
+                                      const int* triangles, int count, TriangleSetup* out )
+{
+    SetupMasks m = { 0, 0, 0, 0 };
+    int valid = (1 << count)-1;
+
+    // Unused lanes repeat the first triangle.
+    alignas(32) int t[SETUP_GROUP];
+    for( int i=0; i<SETUP_GROUP; ++i )
+        t[i] = triangles[i < count ? i : 0];
+    __m256i tri = _mm256_load_si256( (const __m256i*)t );
+    __m256i corner = _mm256_add_epi32( tri, _mm256_add_epi32( tri, tri ) );
+
+    __m256i v[3];
+    for( int k=0; k<3; ++k )
+        v[k] = _mm256_i32gather_epi32( &mesh.indices[0], _mm256_add_epi32( corner, _mm256_set1_epi32( k ) ), 4 );
+
+    int culled = 0;
+    if( view.cull )
+    {
+        const float* normals = &mesh.normals[0].x;
+        __m256 nx = _mm256_i32gather_ps( normals, corner, 4 );
+        __m256 ny = _mm256_i32gather_ps( normals, _mm256_add_epi32( corner, _mm256_set1_epi32( 1 ) ), 4 );
+        __m256 nz = _mm256_i32gather_ps( normals, _mm256_add_epi32( corner, _mm256_set1_epi32( 2 ) ), 4 );
+        __m256 dx = _mm256_sub_ps( _mm256_set1_ps( view.camera.x ), _mm256_i32gather_ps( &mesh.x[0], v[0], 4 ) );
+        __m256 dy = _mm256_sub_ps( _mm256_set1_ps( view.camera.y ), _mm256_i32gather_ps( &mesh.y[0], v[0], 4 ) );
+        __m256 dz = _mm256_sub_ps( _mm256_set1_ps( view.camera.z ), _mm256_i32gather_ps( &mesh.z[0], v[0], 4 ) );
+        __m256 facing = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( nx, dx ), _mm256_mul_ps( ny, dy ) ), _mm256_mul_ps( nz, dz ) );
+        m.backFacing = _mm256_movemask_ps( _mm256_cmp_ps( facing, _mm256_setzero_ps(), _CMP_LE_OQ ) ) & valid;
+
+        __m256i outside = _mm256_i32gather_epi32( &shaded.outside[0], v[0], 4 );
+        outside = _mm256_and_si256( outside, _mm256_i32gather_epi32( &shaded.outside[0], v[1], 4 ) );
+        outside = _mm256_and_si256( outside, _mm256_i32gather_epi32( &shaded.outside[0], v[2], 4 ) );
+        int inside = _mm256_movemask_ps( _mm256_castsi256_ps( _mm256_cmpeq_epi32( outside, _mm256_setzero_si256() ) ) );
+        m.outside = ~inside & valid & ~m.backFacing;
+        culled = m.backFacing | m.outside;
+    }
+
+    __m256i clip = _mm256_i32gather_epi32( &shaded.clip[0], v[0], 4 );
+    clip = _mm256_or_si256( clip, _mm256_i32gather_epi32( &shaded.clip[0], v[1], 4 ) );
+    clip = _mm256_or_si256( clip, _mm256_i32gather_epi32( &shaded.clip[0], v[2], 4 ) );
+    int unclipped = _mm256_movemask_ps( _mm256_castsi256_ps( _mm256_cmpeq_epi32( clip, _mm256_setzero_si256() ) ) );
+    m.clip = ~unclipped & valid & ~culled;
+    int drawn = unclipped & valid & ~culled;
+    if( drawn == 0 )
+        return m;
+
+    __m256i x[3], y[3];
+    __m256 zinv[3];
+    for( int k=0; k<3; ++k )
+    {
+        x[k] = _mm256_i32gather_epi32( &shaded.x[0], v[k], 4 );
+        y[k] = _mm256_i32gather_epi32( &shaded.y[0], v[k], 4 );
+        zinv[k] = _mm256_i32gather_ps( &shaded.zinv[0], v[k], 4 );
+    }
+
+    // Bounding boxes, see SetupScreenTriangle.
+    __m256i round = _mm256_set1_epi32( SUBPIXELS-1 );
+    __m256i minX = _mm256_min_epi32( x[0], _mm256_min_epi32( x[1], x[2] ) );
+    __m256i minY = _mm256_min_epi32( y[0], _mm256_min_epi32( y[1], y[2] ) );
+    __m256i maxX = _mm256_max_epi32( x[0], _mm256_max_epi32( x[1], x[2] ) );
+    __m256i maxY = _mm256_max_epi32( y[0], _mm256_max_epi32( y[1], y[2] ) );
+    minX = _mm256_max_epi32( _mm256_srai_epi32( _mm256_add_epi32( minX, round ), SUBPIXEL_BITS ), _mm256_setzero_si256() );
+    minY = _mm256_max_epi32( _mm256_srai_epi32( _mm256_add_epi32( minY, round ), SUBPIXEL_BITS ), _mm256_setzero_si256() );
+    maxX = _mm256_min_epi32( _mm256_srai_epi32( maxX, SUBPIXEL_BITS ), _mm256_set1_epi32( view.width-1 ) );
+    maxY = _mm256_min_epi32( _mm256_srai_epi32( maxY, SUBPIXEL_BITS ), _mm256_set1_epi32( view.height-1 ) );
+    __m256i empty = _mm256_or_si256( _mm256_cmpgt_epi32( minX, maxX ), _mm256_cmpgt_epi32( minY, maxY ) );
+    drawn &= ~_mm256_movemask_ps( _mm256_castsi256_ps( empty ) );
+
+    // Twice the signed area, see SetupEdges, and the sign that makes the
+    // inside positive.
+    __m256d area[2], sign[2];
+    int negative = 0;
+    for( int h=0; h<2; ++h )
+    {
+        __m256d x0 = SetupHalf( x[0], h ), y0 = SetupHalf( y[0], h );
+        area[h] = _mm256_sub_pd( _mm256_mul_pd( _mm256_sub_pd( SetupHalf( x[1], h ), x0 ), _mm256_sub_pd( SetupHalf( y[2], h ), y0 ) ),
+                                 _mm256_mul_pd( _mm256_sub_pd( SetupHalf( y[1], h ), y0 ), _mm256_sub_pd( SetupHalf( x[2], h ), x0 ) ) );
+        __m256d positive = _mm256_cmp_pd( area[h], _mm256_setzero_pd(), _CMP_GT_OQ );
+        sign[h] = _mm256_blendv_pd( _mm256_set1_pd( -1.0 ), _mm256_set1_pd( 1.0 ), positive );
+        negative |= _mm256_movemask_pd( _mm256_cmp_pd( area[h], _mm256_setzero_pd(), _CMP_LT_OQ ) ) << 4*h;
+        drawn &= ~(_mm256_movemask_pd( _mm256_cmp_pd( area[h], _mm256_setzero_pd(), _CMP_EQ_OQ ) ) << 4*h);
+        area[h] = _mm256_mul_pd( area[h], sign[h] );
+    }
+    if( drawn == 0 )
+        return m;
+    __m256i flip = SetupLanes( negative );
+
+    // Edge functions, with the fill rule bias taken off c where the edge is
+    // neither a top nor a left one.
+    alignas(32) int edgeA[3][SETUP_GROUP], edgeB[3][SETUP_GROUP];
+    alignas(32) double edgeC[3][SETUP_GROUP];
+    __m256 wx[3], wy[3];
+    for( int i=0; i<3; ++i )
+    {
+        int u = (i+1)%3;
+        int w = (i+2)%3;
+        __m256i a = _mm256_sub_epi32( _mm256_xor_si256( _mm256_sub_epi32( y[u], y[w] ), flip ), flip );
+        __m256i b = _mm256_sub_epi32( _mm256_xor_si256( _mm256_sub_epi32( x[w], x[u] ), flip ), flip );
+        __m256i zero = _mm256_setzero_si256();
+        __m256i topLeft = _mm256_or_si256( _mm256_cmpgt_epi32( a, zero ),
+                                           _mm256_and_si256( _mm256_cmpeq_epi32( a, zero ), _mm256_cmpgt_epi32( b, zero ) ) );
+        a = _mm256_slli_epi32( a, SUBPIXEL_BITS );
+        b = _mm256_slli_epi32( b, SUBPIXEL_BITS );
+        _mm256_store_si256( (__m256i*)edgeA[i], a );
+        _mm256_store_si256( (__m256i*)edgeB[i], b );
+
+        __m128 wxHalf[2], wyHalf[2];
+        for( int h=0; h<2; ++h )
+        {
+            __m256d c = _mm256_sub_pd( _mm256_mul_pd( SetupHalf( x[u], h ), SetupHalf( y[w], h ) ),
+                                       _mm256_mul_pd( SetupHalf( y[u], h ), SetupHalf( x[w], h ) ) );
+            __m256d bias = _mm256_andnot_pd( _mm256_castsi256_pd( _mm256_cvtepi32_epi64(
+                h ? _mm256_extracti128_si256( topLeft, 1 ) : _mm256_castsi256_si128( topLeft ) ) ), _mm256_set1_pd( 1.0 ) );
+            _mm256_store_pd( edgeC[i]+4*h, _mm256_sub_pd( _mm256_mul_pd( c, sign[h] ), bias ) );
+            wxHalf[h] = _mm256_cvtpd_ps( _mm256_div_pd( SetupHalf( a, h ), area[h] ) );
+            wyHalf[h] = _mm256_cvtpd_ps( _mm256_div_pd( SetupHalf( b, h ), area[h] ) );
+        }
+        wx[i] = _mm256_insertf128_ps( _mm256_castps128_ps256( wxHalf[0] ), wxHalf[1], 1 );
+        wy[i] = _mm256_insertf128_ps( _mm256_castps128_ps256( wyHalf[0] ), wyHalf[1], 1 );
+    }
+
+    // Attribute planes through vertex 0.
+    __m256 toPixels = _mm256_set1_ps( 1.0f/SUBPIXELS );
+    __m256 x0 = _mm256_mul_ps( _mm256_cvtepi32_ps( x[0] ), toPixels );
+    __m256 y0 = _mm256_mul_ps( _mm256_cvtepi32_ps( y[0] ), toPixels );
+
+    alignas(32) float planes[12][SETUP_GROUP];      // zinv, then posA, posB and posC
+    __m256 zx = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( wx[0], zinv[0] ), _mm256_mul_ps( wx[1], zinv[1] ) ), _mm256_mul_ps( wx[2], zinv[2] ) );
+    __m256 zy = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( wy[0], zinv[0] ), _mm256_mul_ps( wy[1], zinv[1] ) ), _mm256_mul_ps( wy[2], zinv[2] ) );
+    _mm256_store_ps( planes[0], zx );
+    _mm256_store_ps( planes[1], zy );
+    _mm256_store_ps( planes[2], _mm256_sub_ps( _mm256_sub_ps( zinv[0], _mm256_mul_ps( zx, x0 ) ), _mm256_mul_ps( zy, y0 ) ) );
+
+    const float* coordinates[3] = { &mesh.x[0], &mesh.y[0], &mesh.z[0] };
+    for( int j=0; j<3; ++j )
+    {
+        __m256 p[3];
+        for( int k=0; k<3; ++k )
+            p[k] = _mm256_mul_ps( _mm256_i32gather_ps( coordinates[j], v[k], 4 ), zinv[k] );
+        __m256 a = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( wx[0], p[0] ), _mm256_mul_ps( wx[1], p[1] ) ), _mm256_mul_ps( wx[2], p[2] ) );
+        __m256 b = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( wy[0], p[0] ), _mm256_mul_ps( wy[1], p[1] ) ), _mm256_mul_ps( wy[2], p[2] ) );
+        _mm256_store_ps( planes[3+j], a );
+        _mm256_store_ps( planes[6+j], b );
+        _mm256_store_ps( planes[9+j], _mm256_sub_ps( _mm256_sub_ps( p[0], _mm256_mul_ps( a, x0 ) ), _mm256_mul_ps( b, y0 ) ) );
+    }
+
+    alignas(32) int box[4][SETUP_GROUP];
+    _mm256_store_si256( (__m256i*)box[0], minX );
+    _mm256_store_si256( (__m256i*)box[1], minY );
+    _mm256_store_si256( (__m256i*)box[2], maxX );
+    _mm256_store_si256( (__m256i*)box[3], maxY );
+
+    // Compaction: the lanes left in drawn are written out in order.
+    m.drawn = drawn;
+    for( int n=0; drawn; drawn &= drawn-1, ++n )
+    {
+        int i = __builtin_ctz( drawn );
+        TriangleSetup& s = out[n];
+        s.minX = box[0][i];
+        s.minY = box[1][i];
+        s.maxX = box[2][i];
+        s.maxY = box[3][i];
+        for( int k=0; k<3; ++k )
+        {
+            s.edge[k].a = edgeA[k][i];
+            s.edge[k].b = edgeB[k][i];
+            s.edge[k].c = int64_t( edgeC[k][i] );
+        }
+        s.zinv = glm::vec3( planes[0][i], planes[1][i], planes[2][i] );
+        s.posA = glm::vec3( planes[3][i], planes[4][i], planes[5][i] );
+        s.posB = glm::vec3( planes[6][i], planes[7][i], planes[8][i] );
+        s.posC = glm::vec3( planes[9][i], planes[10][i], planes[11][i] );
+        s.color = mesh.colors[t[i]];
+        s.normal = mesh.normals[t[i]];
+    }
+    return m;
+}
+
+#endif
+
+// Names the code path SetupTriangles takes on this CPU.
+inline const char* SetupStageISA()
+{
+#ifdef SETUP_STAGE_X86
+    static const bool avx2 = __builtin_cpu_supports( "avx2" );
+    return avx2 ? "avx2" : "scalar";
+#else
+    return "scalar";
+#endif
+}
+
+inline SetupMasks SetupTriangles( const Mesh& mesh, const ShadedVertices& shaded, const SetupView& view,
+                                  const int* triangles, int count, TriangleSetup* out )
+{
+#ifdef SETUP_STAGE_X86
+    static const bool avx2 = __builtin_cpu_supports( "avx2" );
+    if( avx2 )
+        return SetupTrianglesAVX2( mesh, shaded, view, triangles, count, out );
+#endif
+    return SetupTrianglesScalar( mesh, shaded, view, triangles, count, out );
+}
+
+#endif
@@ -0,0 +1,307 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+// A work-stealing task scheduler. Every thread owns a deque of jobs: it
+// pushes and pops at the back, while idle threads steal from the front of
+// the other deques. Work is described by a TaskGraph whose nodes are
+// parallel loops, and a node starts when all nodes it depends on are done.
+//
+// Run and ParallelFor must be called from the thread that created the pool,
+// which takes part in the work as worker 0, and not from inside a task.
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+class ThreadPool;
+
+// A set of parallel loops and the order between them. A plain task is a
+// loop with a single iteration. The graph can be run any number of times.
+class TaskGraph
+{
+public:
+    ~TaskGraph()
+    {
+        for( size_t i=0; i<nodes.size(); ++i )
+            delete nodes[i];
+    }
+
+    // Adds a task calling body(i) for every i in [0,count). Ranges larger
+    // than grain iterations are split in halves which idle threads steal.
+    int Add( int count, const std::function<void(int)>& body, int grain = 1 )
+    {
+        Node* node = new Node;
+        node->body = body;
+        node->count = count;
+        node->grain = std::max( grain, 1 );
+        nodes.push_back( node );
+        return int(nodes.size())-1;
+    }
+
+    // Makes task 'after' wait until task 'before' is done.
+    void Precede( int before, int after )
+    {
+        nodes[before]->successors.push_back( after );
+        ++nodes[after]->predecessors;
+    }
+
+private:
+    friend class ThreadPool;
+
+    struct Node
+    {
+        std::function<void(int)> body;
+        int count;
+        int grain;
+        int predecessors;
+        std::vector<int> successors;
+        std::atomic<int> pending;       // Predecessors not yet done
+        std::atomic<int> remaining;     // Iterations not yet done
+
+        Node() : count(0), grain(1), predecessors(0) {}
+    };
+
+    std::vector<Node*> nodes;
+    std::atomic<int> unfinished;
+};
+
+class ThreadPool
+{
+public:
+    // Starts threads-1 workers, the calling thread being the last one. Zero
+    // means one thread per hardware thread. With pin set, thread i is bound
+    // to CPU i (where the platform supports it).
+    explicit ThreadPool( int threads = 0, bool pin = false )
+        : graph(0), queued(0), sleepers(0), stopping(false)
+    {
+        int cpus = std::max( 1u, std::thread::hardware_concurrency() );
+        if( threads <= 0 )
+            threads = cpus;
+
+        for( int i=0; i<threads; ++i )
+            queues.push_back( new Queue );
+        if( pin )
+            Pin( CurrentThread(), 0 );
+        for( int i=1; i<threads; ++i )
+        {
+            workers.push_back( std::thread( &ThreadPool::WorkerLoop, this, i ) );
+            if( pin )
+                Pin( workers.back().native_handle(), i % cpus );
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock( sleepMutex );
+            stopping = true;
+        }
+        wake.notify_all();
+        for( size_t i=0; i<workers.size(); ++i )
+            workers[i].join();
+        for( size_t i=0; i<queues.size(); ++i )
+            delete queues[i];
+    }
+
+    int Size() const
+    {
+        return int(queues.size());
+    }
+
+    // Runs all tasks of the graph in dependency order and returns when the
+    // last of them is done.
+    void Run( TaskGraph& g )
+    {
+        if( g.nodes.empty() )
+            return;
+
+        g.unfinished = int(g.nodes.size());
+        for( size_t i=0; i<g.nodes.size(); ++i )
+        {
+            g.nodes[i]->pending = g.nodes[i]->predecessors;
+            g.nodes[i]->remaining = g.nodes[i]->count;
+        }
+
+        graph = &g;
+        for( size_t i=0; i<g.nodes.size(); ++i )
+            if( g.nodes[i]->predecessors == 0 )
+                Release( 0, g.nodes[i] );
+
+        while( g.unfinished > 0 )
+        {
+            Job job;
+            if( Pop( 0, job ) || Steal( 0, job ) )
+                Execute( 0, job );
+            else
+                std::this_thread::yield();
+        }
+        graph = 0;
+    }
+
+    // Calls body(i) for every i in [0,count) and returns when all are done.
+    void ParallelFor( int count, const std::function<void(int)>& body, int grain = 1 )
+    {
+        TaskGraph g;
+        g.Add( count, body, grain );
+        Run( g );
+    }
+
+private:
+    struct Job
+    {
+        TaskGraph::Node* node;
+        int begin, end;
+    };
+
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+
+    // Makes a task whose predecessors are all done available to the workers.
+    void Release( int worker, TaskGraph::Node* node )
+    {
+        if( node->count <= 0 )
+        {
+            Finish( worker, node );
+            return;
+        }
+        Job job = { node, 0, node->count };
+        Push( worker, job );
+    }
+
+    void Finish( int worker, TaskGraph::Node* node )
+    {
+        for( size_t i=0; i<node->successors.size(); ++i )
+        {
+            TaskGraph::Node* next = graph->nodes[node->successors[i]];
+            if( --next->pending == 0 )
+                Release( worker, next );
+        }
+        --graph->unfinished;
+    }
+
+    // Splits off the upper half of the range for other threads until it is
+    // no larger than the grain, then runs what is left.
+    void Execute( int worker, Job job )
+    {
+        TaskGraph::Node* node = job.node;
+        while( job.end - job.begin > node->grain )
+        {
+            Job half = { node, (job.begin+job.end)/2, job.end };
+            Push( worker, half );
+            job.end = half.begin;
+        }
+
+        for( int i=job.begin; i<job.end; ++i )
+            node->body(i);
+
+        int n = job.end - job.begin;
+        if( node->remaining.fetch_sub( n ) == n )
+            Finish( worker, node );
+    }
+
+    void Push( int worker, const Job& job )
+    {
+        {
+            std::lock_guard<std::mutex> lock( queues[worker]->mutex );
+            queues[worker]->jobs.push_back( job );
+        }
+        ++queued;
+        if( sleepers > 0 )
+        {
+            std::lock_guard<std::mutex> lock( sleepMutex );
+            wake.notify_one();
+        }
+    }
+
+    bool Pop( int worker, Job& job )
+    {
+        std::lock_guard<std::mutex> lock( queues[worker]->mutex );
+        if( queues[worker]->jobs.empty() )
+            return false;
+        job = queues[worker]->jobs.back();
+        queues[worker]->jobs.pop_back();
+        --queued;
+        return true;
+    }
+
+    bool Steal( int worker, Job& job )
+    {
+        int n = Size();
+        for( int i=1; i<n; ++i )
+        {
+            Queue& victim = *queues[(worker+i)%n];
+            std::lock_guard<std::mutex> lock( victim.mutex );
+            if( !victim.jobs.empty() )
+            {
+                job = victim.jobs.front();
+                victim.jobs.pop_front();
+                --queued;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void WorkerLoop( int worker )
+    {
+        for( ;; )
+        {
+            Job job;
+            if( Pop( worker, job ) || Steal( worker, job ) )
+            {
+                Execute( worker, job );
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock( sleepMutex );
+            ++sleepers;
+            while( !stopping && queued == 0 )
+                wake.wait( lock );
+            --sleepers;
+            if( stopping )
+                return;
+        }
+    }
+
+#ifdef __linux__
+    typedef pthread_t Handle;
+    static Handle CurrentThread() { return pthread_self(); }
+    static void Pin( Handle thread, int cpu )
+    {
+        cpu_set_t set;
+        CPU_ZERO( &set );
+        CPU_SET( cpu, &set );
+        pthread_setaffinity_np( thread, sizeof(set), &set );
+    }
+#else
+    typedef std::thread::native_handle_type Handle;
+    static Handle CurrentThread() { return Handle(); }
+    static void Pin( Handle, int ) {}
+#endif
+
+    std::vector<std::thread> workers;
+    std::vector<Queue*> queues;
+    TaskGraph* graph;
+
+    // Sleeping workers are woken whenever a job is queued.
+    std::atomic<int> queued;
+    std::atomic<int> sleepers;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    bool stopping;
+};
+
+#endif
@@ -0,0 +1,259 @@
+#ifndef VERTEX_STAGE_H
+#define VERTEX_STAGE_H
+
+// Streaming vertex transform over the structure-of-arrays positions of a
+// Mesh. Every vertex is moved to camera space, classified against two sets
+// of planes and projected to the screen, in 28.4 fixed point pixels. The
+// work is done 8 vertices at a time with AVX2 when the CPU has it, 4 at a
+// time with SSE2 on other x86 CPUs, and one at a time elsewhere.
+
+#include <glm/glm.hpp>
+#include <cmath>
+#include "Mesh.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define VERTEX_STAGE_X86
+#endif
+
+// Projected vertices are rounded to 1/SUBPIXELS of a pixel.
+const int SUBPIXEL_BITS = 4;
+const int SUBPIXELS = 1 << SUBPIXEL_BITS;
+
+// Rounds a screen coordinate to the nearest subpixel, ties to even, as the
+// conversions of the vector versions do.
+inline int ToSubpixels( float x )
+{
+    return int( std::nearbyint( x*SUBPIXELS ) );
+}
+
+// The first pixel at or after a subpixel position, and the last one at or
+// before it. Pixel x is sampled at subpixel x*SUBPIXELS.
+inline int PixelCeil( int subpixels )
+{
+    return (subpixels+SUBPIXELS-1) >> SUBPIXEL_BITS;
+}
+
+inline int PixelFloor( int subpixels )
+{
+    return subpixels >> SUBPIXEL_BITS;
+}
+
+// Camera and planes used by TransformVertices. The planes are camera space
+// half-spaces a*x + b*y + c*z + d >= 0.
+struct VertexTransform
+{
+    glm::mat3 rot;                          // Camera space is (p-position)*rot
+    glm::vec3 position;
+    float focal;
+    float centerX, centerY;
+    const glm::vec4* frustum;               // Sets the outside bits
+    const glm::vec4* clip;                  // Sets the clip bits
+    int planes;
+};
+
+// Output of the vertex stage, one entry per vertex, padded like the mesh.
+struct ShadedVertices
+{
+    IntArray x, y;                          // Projection in subpixels, valid if clip is 0
+    FloatArray zinv;
+    IntArray outside;                       // Bit i set: outside frustum[i]
+    IntArray clip;                          // Bit i set: outside clip[i]
+
+    void Resize( size_t n )
+    {
+        size_t padded = PaddedSize( n );
+        x.resize( padded );
+        y.resize( padded );
+        zinv.resize( padded );
+        outside.resize( padded );
+        clip.resize( padded );
+    }
+};
+
+inline void TransformVerticesScalar( const Mesh& mesh, const VertexTransform& t,
+                                     int begin, int end, ShadedVertices& out )
+{
+    for( int i=begin; i<end; ++i )
+    {
+        glm::vec3 local = (glm::vec3( mesh.x[i], mesh.y[i], mesh.z[i] )-t.position)*t.rot;
+
+        int outside = 0;
+        int clip = 0;
+        for( int j=0; j<t.planes; ++j )
+        {
+            if( glm::dot( glm::vec3(t.frustum[j]), local ) + t.frustum[j].w < 0 )
+                outside |= 1 << j;
+            if( glm::dot( glm::vec3(t.clip[j]), local ) + t.clip[j].w < 0 )
+                clip |= 1 << j;
+        }
+        out.outside[i] = outside;
+        out.clip[i] = clip;
+
+        if( clip == 0 )
+        {
+            float zinv = 1/local.z;
+            out.zinv[i] = zinv;
+            out.x[i] = ToSubpixels( (t.focal * local.x * zinv) + t.centerX );
+            out.y[i] = ToSubpixels( (t.focal * local.y * zinv) + t.centerY );
+        }
+    }
+}
+
+#ifdef VERTEX_STAGE_X86
+
+// The vector versions evaluate the expressions of the scalar one in the
+// same order and without fused multiply-adds, so all three give the same
+// results bit for bit.
+
+inline void TransformVerticesSSE2( const Mesh& mesh, const VertexTransform& t,
+                                   int begin, int end, ShadedVertices& out )
+{
+    const glm::mat3& r = t.rot;
+    __m128 r00 = _mm_set1_ps( r[0][0] ), r01 = _mm_set1_ps( r[0][1] ), r02 = _mm_set1_ps( r[0][2] );
+    __m128 r10 = _mm_set1_ps( r[1][0] ), r11 = _mm_set1_ps( r[1][1] ), r12 = _mm_set1_ps( r[1][2] );
+    __m128 r20 = _mm_set1_ps( r[2][0] ), r21 = _mm_set1_ps( r[2][1] ), r22 = _mm_set1_ps( r[2][2] );
+    __m128 px = _mm_set1_ps( t.position.x );
+    __m128 py = _mm_set1_ps( t.position.y );
+    __m128 pz = _mm_set1_ps( t.position.z );
+    __m128 focal = _mm_set1_ps( t.focal );
+    __m128 cx = _mm_set1_ps( t.centerX );
+    __m128 cy = _mm_set1_ps( t.centerY );
+    __m128 one = _mm_set1_ps( 1.0f );
+    __m128 subpixels = _mm_set1_ps( float(SUBPIXELS) );
+    __m128 zero = _mm_setzero_ps();
+
+    for( int i=begin; i<end; i+=4 )
+    {
+        __m128 dx = _mm_sub_ps( _mm_load_ps( &mesh.x[i] ), px );
+        __m128 dy = _mm_sub_ps( _mm_load_ps( &mesh.y[i] ), py );
+        __m128 dz = _mm_sub_ps( _mm_load_ps( &mesh.z[i] ), pz );
+        __m128 lx = _mm_add_ps( _mm_add_ps( _mm_mul_ps( r00, dx ), _mm_mul_ps( r01, dy ) ), _mm_mul_ps( r02, dz ) );
+        __m128 ly = _mm_add_ps( _mm_add_ps( _mm_mul_ps( r10, dx ), _mm_mul_ps( r11, dy ) ), _mm_mul_ps( r12, dz ) );
+        __m128 lz = _mm_add_ps( _mm_add_ps( _mm_mul_ps( r20, dx ), _mm_mul_ps( r21, dy ) ), _mm_mul_ps( r22, dz ) );
+
+        __m128i outside = _mm_setzero_si128();
+        __m128i clip = _mm_setzero_si128();
+        for( int j=0; j<t.planes; ++j )
+        {
+            const glm::vec4& a = t.frustum[j];
+            __m128 da = _mm_add_ps( _mm_add_ps( _mm_add_ps(
+                _mm_mul_ps( _mm_set1_ps( a.x ), lx ),
+                _mm_mul_ps( _mm_set1_ps( a.y ), ly ) ),
+                _mm_mul_ps( _mm_set1_ps( a.z ), lz ) ),
+                _mm_set1_ps( a.w ) );
+            __m128i bit = _mm_set1_epi32( 1 << j );
+            outside = _mm_or_si128( outside, _mm_and_si128( _mm_castps_si128( _mm_cmplt_ps( da, zero ) ), bit ) );
+
+            const glm::vec4& b = t.clip[j];
+            __m128 db = _mm_add_ps( _mm_add_ps( _mm_add_ps(
+                _mm_mul_ps( _mm_set1_ps( b.x ), lx ),
+                _mm_mul_ps( _mm_set1_ps( b.y ), ly ) ),
+                _mm_mul_ps( _mm_set1_ps( b.z ), lz ) ),
+                _mm_set1_ps( b.w ) );
+            clip = _mm_or_si128( clip, _mm_and_si128( _mm_castps_si128( _mm_cmplt_ps( db, zero ) ), bit ) );
+        }
+        _mm_store_si128( (__m128i*)&out.outside[i], outside );
+        _mm_store_si128( (__m128i*)&out.clip[i], clip );
+
+        // Lanes that need clipping get meaningless values, which are unused.
+        __m128 zinv = _mm_div_ps( one, lz );
+        __m128 x = _mm_add_ps( _mm_mul_ps( _mm_mul_ps( focal, lx ), zinv ), cx );
+        __m128 y = _mm_add_ps( _mm_mul_ps( _mm_mul_ps( focal, ly ), zinv ), cy );
+        _mm_store_ps( &out.zinv[i], zinv );
+        _mm_store_si128( (__m128i*)&out.x[i], _mm_cvtps_epi32( _mm_mul_ps( x, subpixels ) ) );
+        _mm_store_si128( (__m128i*)&out.y[i], _mm_cvtps_epi32( _mm_mul_ps( y, subpixels ) ) );
+    }
+}
+
+__attribute__((target("avx2")))
+inline void TransformVerticesAVX2( const Mesh& mesh, const VertexTransform& t,
+                                   int begin, int end, ShadedVertices& out )
+{
+    const glm::mat3& r = t.rot;
+    __m256 r00 = _mm256_set1_ps( r[0][0] ), r01 = _mm256_set1_ps( r[0][1] ), r02 = _mm256_set1_ps( r[0][2] );
+    __m256 r10 = _mm256_set1_ps( r[1][0] ), r11 = _mm256_set1_ps( r[1][1] ), r12 = _mm256_set1_ps( r[1][2] );
+    __m256 r20 = _mm256_set1_ps( r[2][0] ), r21 = _mm256_set1_ps( r[2][1] ), r22 = _mm256_set1_ps( r[2][2] );
+    __m256 px = _mm256_set1_ps( t.position.x );
+    __m256 py = _mm256_set1_ps( t.position.y );
+    __m256 pz = _mm256_set1_ps( t.position.z );
+    __m256 focal = _mm256_set1_ps( t.focal );
+    __m256 cx = _mm256_set1_ps( t.centerX );
+    __m256 cy = _mm256_set1_ps( t.centerY );
+    __m256 one = _mm256_set1_ps( 1.0f );
+    __m256 subpixels = _mm256_set1_ps( float(SUBPIXELS) );
+    __m256 zero = _mm256_setzero_ps();
+
+    for( int i=begin; i<end; i+=8 )
+    {
+        __m256 dx = _mm256_sub_ps( _mm256_load_ps( &mesh.x[i] ), px );
+        __m256 dy = _mm256_sub_ps( _mm256_load_ps( &mesh.y[i] ), py );
+        __m256 dz = _mm256_sub_ps( _mm256_load_ps( &mesh.z[i] ), pz );
+        __m256 lx = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( r00, dx ), _mm256_mul_ps( r01, dy ) ), _mm256_mul_ps( r02, dz ) );
+        __m256 ly = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( r10, dx ), _mm256_mul_ps( r11, dy ) ), _mm256_mul_ps( r12, dz ) );
+        __m256 lz = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( r20, dx ), _mm256_mul_ps( r21, dy ) ), _mm256_mul_ps( r22, dz ) );
+
+        __m256i outside = _mm256_setzero_si256();
+        __m256i clip = _mm256_setzero_si256();
+        for( int j=0; j<t.planes; ++j )
+        {
+            const glm::vec4& a = t.frustum[j];
+            __m256 da = _mm256_add_ps( _mm256_add_ps( _mm256_add_ps(
+                _mm256_mul_ps( _mm256_set1_ps( a.x ), lx ),
+                _mm256_mul_ps( _mm256_set1_ps( a.y ), ly ) ),
+                _mm256_mul_ps( _mm256_set1_ps( a.z ), lz ) ),
+                _mm256_set1_ps( a.w ) );
+            __m256i bit = _mm256_set1_epi32( 1 << j );
+            outside = _mm256_or_si256( outside, _mm256_and_si256( _mm256_castps_si256( _mm256_cmp_ps( da, zero, _CMP_LT_OQ ) ), bit ) );
+
+            const glm::vec4& b = t.clip[j];
+            __m256 db = _mm256_add_ps( _mm256_add_ps( _mm256_add_ps(
+                _mm256_mul_ps( _mm256_set1_ps( b.x ), lx ),
+                _mm256_mul_ps( _mm256_set1_ps( b.y ), ly ) ),
+                _mm256_mul_ps( _mm256_set1_ps( b.z ), lz ) ),
+                _mm256_set1_ps( b.w ) );
+            clip = _mm256_or_si256( clip, _mm256_and_si256( _mm256_castps_si256( _mm256_cmp_ps( db, zero, _CMP_LT_OQ ) ), bit ) );
+        }
+        _mm256_store_si256( (__m256i*)&out.outside[i], outside );
+        _mm256_store_si256( (__m256i*)&out.clip[i], clip );
+
+        __m256 zinv = _mm256_div_ps( one, lz );
+        __m256 x = _mm256_add_ps( _mm256_mul_ps( _mm256_mul_ps( focal, lx ), zinv ), cx );
+        __m256 y = _mm256_add_ps( _mm256_mul_ps( _mm256_mul_ps( focal, ly ), zinv ), cy );
+        _mm256_store_ps( &out.zinv[i], zinv );
+        _mm256_store_si256( (__m256i*)&out.x[i], _mm256_cvtps_epi32( _mm256_mul_ps( x, subpixels ) ) );
+        _mm256_store_si256( (__m256i*)&out.y[i], _mm256_cvtps_epi32( _mm256_mul_ps( y, subpixels ) ) );
+    }
+}
+
+#endif
+
+// Names the code path TransformVertices takes on this CPU.
+inline const char* VertexStageISA()
+{
+#ifdef VERTEX_STAGE_X86
+    static const bool avx2 = __builtin_cpu_supports( "avx2" );
+    return avx2 ? "avx2" : "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+// Processes the vertices [begin,end). Both must be multiples of SIMD_WIDTH,
+// except that end may be the vertex count of the mesh.
+inline void TransformVertices( const Mesh& mesh, const VertexTransform& t,
+                              int begin, int end, ShadedVertices& out )
+{
+#ifdef VERTEX_STAGE_X86
+    static const bool avx2 = __builtin_cpu_supports( "avx2" );
+    end = int(PaddedSize( end ));
+    if( avx2 )
+        TransformVerticesAVX2( mesh, t, begin, end, out );
+    else
+        TransformVerticesSSE2( mesh, t, begin, end, out );
+#else
+    TransformVerticesScalar( mesh, t, begin, end, out );
+#endif
+}
+
+#endif
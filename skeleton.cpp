@@ -1,12 +1,24 @@
 #include <iostream>
+#include <cstring>
 #include <glm/glm.hpp>
 #include <SDL.h>
 #include "SDLauxiliary.h"
 #include "TestModel.h"
+#include "Mesh.h"
+#include "VertexStage.h"
+#include "BVH.h"
+#include "HierarchicalZ.h"
+#include "RasterRow.h"
+#include "SetupStage.h"
+#include "Occlusion.h"
+#include "Lighting.h"
+#include "ThreadPool.h"
+#include "FrameArena.h"
 
 using namespace std;
 using glm::vec3;
 using glm::vec2;
+using glm::vec4;
 using glm::mat3;
 
 // ----------------------------------------------------------------------------
@@ -25,18 +37,182 @@ struct Vertex
     vec3 position;
 };
 
+// Temporaries in transient memory, see FrameMemory.
+typedef vector<Pixel, ArenaAllocator<Pixel> > Pixels;
+typedef vector<Vertex, ArenaAllocator<Vertex> > Vertices;
+
+// What RasterizeTriangle does with the fragments of a triangle.
+enum RasterPass
+{
+    PASS_SHADE,                     // Depth test, write depth and shade
+    PASS_DEPTH,                     // Depth test and write depth only
+    PASS_EQUAL                      // Shade where the depth equals the stored one
+};
+
+// Depth and color buffers and clip rectangle a triangle is rasterized into.
+// Both are stored in tiles (see TiledIndex): the depth of pixel (x,y) is
+// depth[TiledIndex( depthTilesX, x-x0, y-y0 )], while color covers the whole
+// screen and is addressed by (x,y) itself. x0 and y0 are multiples of
+// BUFFER_TILE, so each block of HIZ_BLOCK x HIZ_BLOCK pixels that
+// RasterizeTriangle works in lies within a single tile of both. The blocks
+// of the hierarchical depth buffer, if any, are aligned to (x0,y0). If ids is
+// set, pixels are not shaded but get the id of the triangle in a visibility
+// buffer laid out like depth.
+struct RenderTarget
+{
+    float* depth;
+    int depthTilesX;
+    ColorBuffer* color;
+    int* ids;                       // Visibility buffer, or 0
+    RasterPass pass;
+    struct DepthCounts* counts;     // Depth test statistics of this target
+    int x0, y0, x1, y1;             // Clip rectangle, x1 and y1 exclusive
+    HierarchicalZ* hiz;             // Summary of depth, or 0
+    vector<int>* cleared;           // See ClearState, or 0 if cleared up front
+};
+
+// Lazy clearing of a full screen depth and color buffer: the frame in which
+// each CLEAR_BLOCK x CLEAR_BLOCK block was last drawn to, or -1 if it has
+// been cleared since. A block is cleared when the first triangle of a frame
+// touches it, while it is about to be in the cache anyway, and the blocks
+// that were drawn to before but not in this frame are cleared once it is
+// done. Blocks that stay empty cost nothing.
+typedef vector<int> ClearState;
+
+// Number of triangles removed by each culling test.
+struct CullCounts
+{
+    int tested;
+    int backFacing;
+    int outside;
+    int occluded;
+};
+
+// Fragments covered by a triangle that reached the per-pixel depth test,
+// and how many of them failed it.
+struct DepthCounts
+{
+    int tested;
+    int failed;
+};
+
+// Private buffers of one thread in sort-last rendering. The depth is tiled
+// like the color.
+struct Layer
+{
+    FloatArray depth;
+    ColorBuffer color;
+    HierarchicalZ hiz;
+    ClearState cleared;
+};
+
+// Rasterization
+enum RenderMode
+{
+    RENDER_SCANLINE,                // ComputePolygonRows/DrawRows
+    RENDER_EDGE,                    // Bounding box traversal with edge functions
+    RENDER_TILED,                   // Binned into screen tiles, tiles in parallel
+    RENDER_SORT_LAST,               // Triangles split over threads, z-composited
+    RENDER_VISIBILITY,              // Triangle ids rasterized, then shaded once
+    RENDER_Z_PREPASS,               // Depth rasterized, then equal depth shaded
+    RENDER_MODES
+};
+const char* renderModeNames[] = { "scanline", "edge", "tiled", "sortlast", "visibility", "zprepass" };
+RenderMode renderMode = RENDER_EDGE;
+
 // Screen
 const int SCREEN_HEIGHT = 500;
 const int SCREEN_WIDTH = 500;
+const int SCREEN_TILES_X = (SCREEN_WIDTH+BUFFER_TILE-1)/BUFFER_TILE;
+const int SCREEN_TILES_Y = (SCREEN_HEIGHT+BUFFER_TILE-1)/BUFFER_TILE;
+const int SCREEN_BUFFER_SIZE = SCREEN_TILES_X*SCREEN_TILES_Y*TILE_PIXELS;  // See ScreenIndex
 SDL_Surface* screen;
 
+// Clipping
+const float NEAR_PLANE = 0.05f;
+const int GUARD_BAND = 1000;            // Pixels beyond each edge of the screen
+const int CLIP_PLANES = 5;
+const int MAX_CLIPPED_VERTICES = 3+CLIP_PLANES;
+const int MAX_CLIPPED_TRIANGLES = MAX_CLIPPED_VERTICES-2;
+vec4 frustumPlanes[CLIP_PLANES];        // Camera space, see ViewPlanes
+vec4 clipPlanes[CLIP_PLANES];
+
+// Culling
+bool cullEnabled = true;
+bool hizEnabled = true;
+bool occlusionEnabled = true;
+const int OCCLUSION_SCALE = 4;          // Screen pixels per occlusion cell side
+const float OCCLUDER_AREA = 0.05f;      // See SelectOccluders
+OcclusionBuffer occlusionBuffer;
+vector<int> occluders;
+const float HIZ_SLACK = 1e-5f;          // Relative error of stepped 1/z
+const int CLEAR_BLOCK = HIZ_BLOCK;      // RasterizeTriangle works in these
+const int CLEAR_BLOCKS = ((SCREEN_WIDTH+CLEAR_BLOCK-1)/CLEAR_BLOCK)*((SCREEN_HEIGHT+CLEAR_BLOCK-1)/CLEAR_BLOCK);
+vec4 worldFrustum[CLIP_PLANES];         // See CullScene
+BVH bvh;
+BVHVisible visible;
+vector<int> visibleTriangles;           // Triangles drawn this frame
+CullCounts cullCounts;
+std::mutex cullMutex;
+
+// Draw order
+bool sortEnabled = true;
+const int SORT_BLOCK = 4096;            // Triangles per depth key task
+vector<vec3> triangleCenters;
+vector<Uint32> sortKeys;                // Of visibleTriangles, see SortTriangles
+vector<Uint32> sortKeysTemp;
+vector<int> sortTrianglesTemp;
+DepthCounts depthCounts;
+std::mutex depthMutex;
+
+// Tiles
+const int TILE_SIZE = 32;
+const int TILES_X = (SCREEN_WIDTH+TILE_SIZE-1)/TILE_SIZE;
+const int TILES_Y = (SCREEN_HEIGHT+TILE_SIZE-1)/TILE_SIZE;
+const int TILES = TILES_X*TILES_Y;
+const int BIN_BATCH = 256;              // Triangles binned by one task
+vector< vector<TriangleSetup> > batchSetups;
+vector< vector<int> > tileBins;         // Bins of batch b start at b*TILES
+
+// Layers
+vector<Layer> layers;
+
+// Visibility buffer
+alignas(SIMD_ALIGN) int visibilityBuffer[SCREEN_BUFFER_SIZE];
+vector<TriangleSetup> frameSetups;      // Set up this frame, see RENDER_VISIBILITY
+Fragments gbuffer;                      // Surfaces seen by the last visibility frame
+bool relightEnabled = true;
+bool gbufferValid = false;
+vec3 gbufferCamera;                     // View the G-buffer was made for
+mat3 gbufferRot;
+
+// Threads
+int threadCount = 0;
+bool pinThreads = false;
+ThreadPool* threadPool;
+
 // Ticker
  int t;
+int frameLimit = 0;
+int frames = 0;
+float totalTime = 0;
 
 // World
-vector<Triangle> triangles;
-float depthBuffer[SCREEN_HEIGHT+1][SCREEN_WIDTH+1];
+Mesh mesh;
+ShadedVertices shaded;
+VertexTransform vertexTransform;
+const int VERTEX_BLOCK = 1024;          // Vertices per vertex stage task
+vector<BVHRange> vertexBlocks;          // Vertex stage tasks this frame
+alignas(SIMD_ALIGN) float depthBuffer[SCREEN_BUFFER_SIZE];
+ClearState screenCleared;               // Of depthBuffer and frameBuffer
+ColorBuffer frameBuffer;                // Shown with Present
+PixelLayout screenLayout;
+bool srgbEnabled = false;
+uint32_t srgbTable[SRGB_LEVELS];
+HierarchicalZ screenHiZ;
 vec3 currentNormal;
+int spanStep = 8;                       // Pixels per exact divide, see InterpolateSpan
+float spanError;                        // Bound on the pos3d error this frame
 
 // Camera
 int f = 250;
@@ -59,39 +235,225 @@ float thetaZ = 0;
 // FUNCTIONS
 
 // Headers
+void ParseArguments( int argc, char* argv[] );
+FrameArena& FrameMemory();
+void SetRenderMode( RenderMode mode );
 void Update();
 void Draw();
-void DrawPolygon( const vector<Vertex>& vertices );
+int ScreenIndex( int x, int y );
+void ClearTileRow( int ty );
+void TouchBlock( const RenderTarget& target, int bx, int by );
+void FinishClear( const RenderTarget& target );
+void ClearBlock( const RenderTarget& target, int bx, int by, bool stream );
+void Present();
+void PresentRow( int y );
+void DrawTiled();
+void BinBatch( int batch );
+void BinTriangle( const TriangleSetup& s, int index, vector<int>* bins );
+void DrawTile( int tile );
+void DrawSortLast();
+void DrawLayer( int index );
+void CompositeTileRow( int ty );
+void ShadeVisibilityTileRow( int ty );
+void Relight();
+void LightTileRow( int ty );
+void ViewPlanes( float margin, vec4* planes );
+void UpdateCamera();
+void CullScene();
+void DrawOccluders();
+bool NodeOccluded( const BVHNode& node );
+void SortTriangles();
+void DepthKeys( int block );
+void RadixSort( vector<Uint32>& keys, vector<int>& values );
+void AddDepthCounts( const DepthCounts& counts );
+void BeginVertexStage();
+int VertexBlocks();
+void ShadeVertexBlock( int block );
+int SetupGroup( int begin, int end, TriangleSetup* out, CullCounts& counts );
+int ClipTriangle( int index, TriangleSetup* out );
+bool CullTriangle( int index, CullCounts& counts );
+void AddCullCounts( const CullCounts& counts );
+void ClipPolygon( Vertices& polygon );
+void DrawPolygon( const Vertices& vertices );
+void DrawShadedTriangle( int index );
+void DrawPixels( const Pixels& vertexPixels );
 void VertexShader( const Vertex& v, Pixel& p );
+void ProjectVertex( const Vertex& v, Pixel& p );
 void ComputePolygonRows(
-                        const vector<Pixel>& vertexPixels,
-                        vector<Pixel>& leftPixels,
-                        vector<Pixel>& rightPixels );
-void Interpolate( Pixel a, Pixel b, vector<Pixel>& result );
+                        const Pixels& vertexPixels,
+                        Pixels& leftPixels,
+                        Pixels& rightPixels );
+void Interpolate( Pixel a, Pixel b, Pixels& result );
+void InterpolateSpan( Pixel a, Pixel b, Pixels& result );
 void DrawRows(
-              const vector<Pixel>& leftPixels,
-              const vector<Pixel>& rightPixels );
+              const Pixels& leftPixels,
+              const Pixels& rightPixels );
+Pixel SpanPixel( const Pixel& a, const Pixel& b, int x );
+bool SetupTriangle(
+                   const Pixel& v0,
+                   const Pixel& v1,
+                   const Pixel& v2,
+                   TriangleSetup& s );
+void RasterizeTriangle( const TriangleSetup& s, const RenderTarget& target );
+float RasterizeBlock( const TriangleSetup& s, const RenderTarget& target,
+                      int x0, int y0, int x1, int y1, bool depthTest );
+float BlockMinDepth( const RenderTarget& target, int bx, int by );
+float PlaneMax( const vec3& q, int x0, int y0, int x1, int y1 );
+float PlaneMin( const vec3& q, int x0, int y0, int x1, int y1 );
 void PixelShader( const Pixel& p );
-vec3 Light( const Pixel& i );
+vec3 Light( const Pixel& i, const vec3& normal );
 void Rotate();
 
 // Implementation
 int main( int argc, char* argv[] )
 {
+        ParseArguments( argc, argv );
+        ViewPlanes( 0, frustumPlanes );
+        ViewPlanes( GUARD_BAND, clipPlanes );
+
+        vector<Triangle> triangles;
         LoadTestModel( triangles );
+        BuildMesh( triangles, mesh );
+        BuildBVH( mesh, bvh );
+        SelectOccluders( mesh, OCCLUDER_AREA, occluders );
+        triangleCenters.resize( mesh.TriangleCount() );
+        for( int i=0; i<mesh.TriangleCount(); ++i )
+            triangleCenters[i] = (mesh.Position( i, 0 ) + mesh.Position( i, 1 ) + mesh.Position( i, 2 ))/3.0f;
+        occlusionBuffer.Resize( SCREEN_WIDTH, SCREEN_HEIGHT, OCCLUSION_SCALE, NEAR_PLANE );
+        cout << "Mesh: " << mesh.TriangleCount() << " triangles, "
+             << mesh.VertexCount() << " vertices, "
+             << bvh.nodes.size() << " BVH nodes, "
+             << occluders.size() << " occluders." << endl;
+        cout << "Vertex stage: " << VertexStageISA() << endl;
+        cout << "Triangle setup: " << SetupStageISA() << endl;
+        cout << "Rasterizer: " << RasterRowISA() << endl;
+        threadPool = new ThreadPool( threadCount, pinThreads );
+        screenHiZ.Resize( SCREEN_WIDTH, SCREEN_HEIGHT );
+        gbuffer.Resize( SCREEN_BUFFER_SIZE );
+        frameBuffer.Resize( SCREEN_WIDTH, SCREEN_HEIGHT );
+        screenCleared.assign( CLEAR_BLOCKS, -1 );
         Rotate();
         screen = InitializeSDL( SCREEN_WIDTH, SCREEN_HEIGHT );
+        screenLayout = PixelLayoutSDL( screen );
+        if( srgbEnabled )
+        {
+            BuildSRGBTable( srgbTable );
+            screenLayout.srgb = srgbTable;
+        }
         t = SDL_GetTicks();	// Set start value for timer.
 
-        while( NoQuitMessageSDL() )
+        while( NoQuitMessageSDL() && (frameLimit == 0 || frames < frameLimit) )
         {
                 Update();
                 Draw();
         }
 
+        if( frames > 1 )
+            cout << "Average render time: " << totalTime/(frames-1) << " ms." << endl;
+
         SDL_SaveBMP( screen, "screenshot.bmp" );
+        delete threadPool;
         return 0;
 }
+void ParseArguments( int argc, char* argv[] )
+{
+    for( int i=1; i<argc; ++i )
+    {
+        string arg = argv[i];
+        bool found = false;
+
+        if( arg == "--mode" && i+1 < argc )
+        {
+            string name = argv[++i];
+            for( int m=0; m<RENDER_MODES; ++m )
+            {
+                if( name == renderModeNames[m] )
+                {
+                    renderMode = RenderMode(m);
+                    found = true;
+                }
+            }
+        }
+        else if( arg == "--threads" && i+1 < argc )
+        {
+            threadCount = atoi( argv[++i] );
+            found = threadCount > 0;
+        }
+        else if( arg == "--frames" && i+1 < argc )
+        {
+            frameLimit = atoi( argv[++i] );
+            found = frameLimit > 0;
+        }
+        else if( arg == "--pin" )
+        {
+            pinThreads = true;
+            found = true;
+        }
+        else if( arg == "--no-cull" )
+        {
+            cullEnabled = false;
+            found = true;
+        }
+        else if( arg == "--no-hiz" )
+        {
+            hizEnabled = false;
+            found = true;
+        }
+        else if( arg == "--no-occlusion" )
+        {
+            occlusionEnabled = false;
+            found = true;
+        }
+        else if( arg == "--no-relight" )
+        {
+            relightEnabled = false;
+            found = true;
+        }
+        else if( arg == "--no-sort" )
+        {
+            sortEnabled = false;
+            found = true;
+        }
+        else if( arg == "--srgb" )
+        {
+            srgbEnabled = true;
+            found = true;
+        }
+        else if( arg == "--span" && i+1 < argc )
+        {
+            spanStep = atoi( argv[++i] );
+            found = spanStep > 0;
+        }
+
+        if( !found )
+        {
+            cout << "Usage: " << argv[0]
+                 << " [--mode scanline|edge|tiled|sortlast|visibility|zprepass]"
+                 << " [--threads N]"
+                 << " [--pin] [--frames N] [--no-cull] [--no-hiz]"
+                 << " [--no-occlusion] [--no-relight] [--no-sort] [--srgb]"
+                 << " [--span N]" << endl;
+            exit(1);
+        }
+    }
+    cout << "Render mode: " << renderModeNames[renderMode] << endl;
+}
+// Returns the arena of the calling thread for memory that is not needed
+// beyond the current frame. It is emptied at its first use in each frame,
+// and functions release their temporaries earlier with an ArenaScope.
+FrameArena& FrameMemory()
+{
+    static thread_local FrameArena arena;
+    arena.BeginFrame( frames );
+    return arena;
+}
+void SetRenderMode( RenderMode mode )
+{
+    if( mode == renderMode )
+        return;
+    renderMode = mode;
+    cout << "Render mode: " << renderModeNames[renderMode] << endl;
+}
 void Update()
 {
         // Compute frame time:
@@ -99,6 +461,21 @@ void Update()
         float dt = float(t2-t);
         t = t2;
         cout << "Render time: " << dt << " ms." << endl;
+        if( cullEnabled )
+            cout << "Culled: " << cullCounts.backFacing << " back-facing, "
+                 << cullCounts.outside << " outside the view, "
+                 << cullCounts.occluded << " occluded, of "
+                 << cullCounts.tested << " triangles." << endl;
+        if( depthCounts.tested > 0 )
+            cout << "Depth test: " << depthCounts.failed << " of "
+                 << depthCounts.tested << " fragments failed ("
+                 << 100.0f*depthCounts.failed/depthCounts.tested << "%)." << endl;
+        if( renderMode == RENDER_SCANLINE && spanStep > 1 )
+            cout << "Span interpolation error: at most " << spanError << "." << endl;
+
+        // The first frame also includes the startup time.
+        if( frames++ > 0 )
+            totalTime += dt;
 
         Uint8* keystate = SDL_GetKeyState(0);
 
@@ -171,6 +548,26 @@ void Update()
         if( keystate[SDLK_q] )
                 ;
 
+    // Render mode
+
+    if( keystate[SDLK_1] )
+        SetRenderMode( RENDER_SCANLINE );
+
+    if( keystate[SDLK_2] )
+        SetRenderMode( RENDER_EDGE );
+
+    if( keystate[SDLK_3] )
+        SetRenderMode( RENDER_TILED );
+
+    if( keystate[SDLK_4] )
+        SetRenderMode( RENDER_SORT_LAST );
+
+    if( keystate[SDLK_5] )
+        SetRenderMode( RENDER_VISIBILITY );
+
+    if( keystate[SDLK_6] )
+        SetRenderMode( RENDER_Z_PREPASS );
+
     Rotate();
 
 }
@@ -188,46 +585,845 @@ void Rotate()
 }
 void Draw()
 {
-        SDL_FillRect( screen, 0, 0 );
+    // If only the light has moved since the last visibility frame, its
+    // G-buffer still holds every visible surface and no geometry is needed.
+    if( renderMode == RENDER_VISIBILITY && relightEnabled && gbufferValid &&
+        camPosition == gbufferCamera && rot == gbufferRot )
+    {
+        Relight();
+        return;
+    }
+    gbufferValid = false;
+
+    cullCounts.tested = 0;
+    cullCounts.backFacing = 0;
+    cullCounts.outside = 0;
+    cullCounts.occluded = 0;
+    depthCounts.tested = 0;
+    depthCounts.failed = 0;
+    spanError = 0;
+    UpdateCamera();
+    CullScene();
+    if( sortEnabled )
+        SortTriangles();
+    BeginVertexStage();
+
+    // The other modes write every pixel without keeping track of it, so
+    // afterwards all blocks count as drawn to.
+    if( renderMode == RENDER_TILED || renderMode == RENDER_SORT_LAST || renderMode == RENDER_SCANLINE )
+        screenCleared.assign( CLEAR_BLOCKS, frames );
+    if( renderMode == RENDER_TILED )
+    {
+        DrawTiled();
+        return;
+    }
+    if( renderMode == RENDER_SORT_LAST )
+    {
+        DrawSortLast();
+        return;
+    }
 
-        if( SDL_MUSTLOCK(screen) )
-                SDL_LockSurface(screen);
+    if( renderMode == RENDER_SCANLINE )
+        threadPool->ParallelFor( SCREEN_TILES_Y, ClearTileRow, 2 );
+    threadPool->ParallelFor( VertexBlocks(), ShadeVertexBlock );
+    screenHiZ.Clear();
 
-        // Clear the depthBuffer
-    for( int y=0; y<SCREEN_HEIGHT; ++y )
-        for( int x=0; x<SCREEN_WIDTH; ++x )
-            depthBuffer[y][x] = 0;
+    if( renderMode == RENDER_EDGE || renderMode == RENDER_VISIBILITY || renderMode == RENDER_Z_PREPASS )
+    {
+        RenderTarget target;
+        target.depth = depthBuffer;
+        target.depthTilesX = SCREEN_TILES_X;
+        target.color = &frameBuffer;
+        target.ids = renderMode == RENDER_VISIBILITY ? visibilityBuffer : 0;
+        target.pass = renderMode == RENDER_Z_PREPASS ? PASS_DEPTH : PASS_SHADE;
+        target.counts = &depthCounts;
+        target.x0 = 0;
+        target.y0 = 0;
+        target.x1 = SCREEN_WIDTH;
+        target.y1 = SCREEN_HEIGHT;
+        target.hiz = hizEnabled ? &screenHiZ : 0;
+        target.cleared = &screenCleared;
+
+        frameSetups.clear();
+        int count = int(visibleTriangles.size());
+        for( int k=0; k<count; k+=SETUP_GROUP )
+        {
+            TriangleSetup setups[SETUP_GROUP*MAX_CLIPPED_TRIANGLES];
+            int n = SetupGroup( k, min( k+SETUP_GROUP, count ), setups, cullCounts );
+            for( int j=0; j<n; ++j )
+            {
+                if( renderMode != RENDER_EDGE )
+                {
+                    setups[j].id = int(frameSetups.size());
+                    frameSetups.push_back( setups[j] );
+                }
+                RasterizeTriangle( setups[j], target );
+            }
+        }
 
-    for( int i=0; i<triangles.size(); ++i )
+        // With the final depth known, the triangles are drawn again and
+        // only the fragment that is seen at each pixel is shaded.
+        if( target.pass == PASS_DEPTH )
         {
-                vector<Vertex> vertices(3);
+            target.pass = PASS_EQUAL;
+            for( size_t k=0; k<frameSetups.size(); ++k )
+                RasterizeTriangle( frameSetups[k], target );
+        }
+        FinishClear( target );
 
-        vertices[0].position = triangles[i].v0;
-        vertices[1].position = triangles[i].v1;
-        vertices[2].position = triangles[i].v2;
+        // Deferred shading: with the nearest triangle of every pixel known,
+        // each pixel is lit exactly once however often it was overdrawn.
+        if( target.ids )
+        {
+            threadPool->ParallelFor( SCREEN_TILES_Y, ShadeVisibilityTileRow, 2 );
+            gbufferValid = true;
+            gbufferCamera = camPosition;
+            gbufferRot = rot;
+        }
+    }
+    else
+    for( size_t k=0; k<visibleTriangles.size(); ++k )
+        {
+        int i = visibleTriangles[k];
+        if( CullTriangle( i, cullCounts ) )
+            continue;
+
+        ArenaScope scope( FrameMemory() );
+        color = mesh.colors[i];
+        currentNormal = mesh.normals[i];
+
+        // Triangles within the guard band use the projections of the vertex
+        // stage, only the others are clipped and projected here.
+        const int* v = &mesh.indices[3*i];
+        if( !(shaded.clip[v[0]] | shaded.clip[v[1]] | shaded.clip[v[2]]) )
+        {
+            DrawShadedTriangle( i );
+            continue;
+        }
+
+                Vertices vertices( 3, Vertex(), FrameMemory() );
 
-        color = triangles[i].color;
-        currentNormal = triangles[i].normal;
+        vertices[0].position = mesh.Position( i, 0 );
+        vertices[1].position = mesh.Position( i, 1 );
+        vertices[2].position = mesh.Position( i, 2 );
+
+        ClipPolygon( vertices );
+        if( vertices.size() < 3 )
+            continue;
 
                 // Add drawing
         DrawPolygon( vertices );
 
     }
 
-        if ( SDL_MUSTLOCK(screen) )
-                SDL_UnlockSurface(screen);
+    Present();
+}
+// Position of pixel (x,y) in the screen sized buffers, which are all tiled
+// like frameBuffer.
+int ScreenIndex( int x, int y )
+{
+    return TiledIndex( SCREEN_TILES_X, x, y );
+}
+// Clears a row of tiles of the frame buffer and the depthBuffer, which is
+// contiguous in both.
+void ClearTileRow( int ty )
+{
+    int begin = ty*SCREEN_TILES_X*TILE_PIXELS;
+    int end = begin + SCREEN_TILES_X*TILE_PIXELS;
+    fill( &frameBuffer.r[begin], &frameBuffer.r[0]+end, 0.0f );
+    fill( &frameBuffer.g[begin], &frameBuffer.g[0]+end, 0.0f );
+    fill( &frameBuffer.b[begin], &frameBuffer.b[0]+end, 0.0f );
+    fill( depthBuffer+begin, depthBuffer+end, 0.0f );
+}
+// Makes sure that block (bx,by) of a lazily cleared target is clear before
+// the first triangle of the frame draws to it.
+void TouchBlock( const RenderTarget& target, int bx, int by )
+{
+    int& drawn = (*target.cleared)[by*((target.x1-target.x0+CLEAR_BLOCK-1)/CLEAR_BLOCK)+bx];
+    if( drawn == frames )
+        return;
+    if( drawn >= 0 )
+        ClearBlock( target, bx, by, false );
+    drawn = frames;
+}
+// Clears the blocks of a lazily cleared target that were drawn to in an
+// earlier frame but not in this one. Nothing reads them before the next
+// frame, so they are written around the cache.
+void FinishClear( const RenderTarget& target )
+{
+    int blocksX = (target.x1-target.x0+CLEAR_BLOCK-1)/CLEAR_BLOCK;
+    int blocksY = (target.y1-target.y0+CLEAR_BLOCK-1)/CLEAR_BLOCK;
+    vector<int>& cleared = *target.cleared;
+    for( int by=0; by<blocksY; ++by )
+    {
+        for( int bx=0; bx<blocksX; ++bx )
+        {
+            int& drawn = cleared[by*blocksX+bx];
+            if( drawn >= 0 && drawn != frames )
+            {
+                ClearBlock( target, bx, by, true );
+                drawn = -1;
+            }
+        }
+    }
+    StreamFence();
+}
+// Clears the tile that holds a block, padding included.
+void ClearBlock( const RenderTarget& target, int bx, int by, bool stream )
+{
+    int x0 = bx*CLEAR_BLOCK;
+    int y0 = by*CLEAR_BLOCK;
+    ColorBuffer& color = *target.color;
+    int pixel = color.Index( target.x0+x0, target.y0+y0 );
+    float* tiles[4] = { target.depth + TiledIndex( target.depthTilesX, x0, y0 ),
+                        &color.r[pixel], &color.g[pixel], &color.b[pixel] };
+    for( int i=0; i<4; ++i )
+    {
+        if( stream )
+            StreamZero( tiles[i], TILE_PIXELS );
+        else
+            fill( tiles[i], tiles[i]+TILE_PIXELS, 0.0f );
+    }
+}
+// Shows the frame buffer, converted to the pixels of the screen in
+// parallel rows.
+void Present()
+{
+    if( SDL_MUSTLOCK(screen) )
+        SDL_LockSurface(screen);
+
+    threadPool->ParallelFor( SCREEN_HEIGHT, PresentRow, 16 );
 
-        SDL_UpdateRect( screen, 0, 0, 0, 0 );
+    if( SDL_MUSTLOCK(screen) )
+        SDL_UnlockSurface(screen);
+
+    SDL_UpdateRect( screen, 0, 0, 0, 0 );
+}
+void PresentRow( int y )
+{
+    PackRow( frameBuffer, y, screenLayout, (Uint32*)screen->pixels + y*screen->pitch/4 );
+}
+// Sort-middle rendering: the triangles are transformed, set up and sorted
+// into the tiles their bounding box overlaps in batches of BIN_BATCH. Each
+// batch has its own bins, so batches are binned in parallel without locks.
+// Once all batches are done, each tile is rendered by a single thread with
+// its own depth buffer and writes only the pixels inside the tile, so the
+// workers never share any memory.
+void DrawTiled()
+{
+    int batches = (int(visibleTriangles.size())+BIN_BATCH-1)/BIN_BATCH;
+    batchSetups.resize( batches );
+    tileBins.resize( batches*TILES );
+
+    TaskGraph graph;
+    int shade = graph.Add( VertexBlocks(), ShadeVertexBlock );
+    int bin = graph.Add( batches, BinBatch );
+    int draw = graph.Add( TILES, DrawTile );
+    graph.Precede( shade, bin );
+    graph.Precede( bin, draw );
+    threadPool->Run( graph );
+
+    Present();
+}
+void BinBatch( int batch )
+{
+    vector<TriangleSetup>& setups = batchSetups[batch];
+    vector<int>* bins = &tileBins[batch*TILES];
+    setups.clear();
+    for( int i=0; i<TILES; ++i )
+        bins[i].clear();
+
+    CullCounts counts = { 0, 0, 0, 0 };
+    int end = min( (batch+1)*BIN_BATCH, int(visibleTriangles.size()) );
+    for( int k=batch*BIN_BATCH; k<end; k+=SETUP_GROUP )
+    {
+        TriangleSetup group[SETUP_GROUP*MAX_CLIPPED_TRIANGLES];
+        int n = SetupGroup( k, min( k+SETUP_GROUP, end ), group, counts );
+        for( int j=0; j<n; ++j )
+        {
+            setups.push_back( group[j] );
+            BinTriangle( group[j], int(setups.size())-1, bins );
+        }
+    }
+    AddCullCounts( counts );
+}
+// Adds a triangle to the bin of every tile that its bounding box overlaps,
+// skipping tiles that lie completely outside one of its edges.
+void BinTriangle( const TriangleSetup& s, int index, vector<int>* bins )
+{
+    for( int ty = s.minY/TILE_SIZE; ty <= s.maxY/TILE_SIZE; ++ty )
+    {
+        for( int tx = s.minX/TILE_SIZE; tx <= s.maxX/TILE_SIZE; ++tx )
+        {
+            int x0 = tx*TILE_SIZE;
+            int y0 = ty*TILE_SIZE;
+            bool outside = false;
+            for( int i=0; i<3; ++i )
+                if( EdgeMax( s.edge[i], x0, y0, x0+TILE_SIZE-1, y0+TILE_SIZE-1 ) < 0 )
+                    outside = true;
+            if( !outside )
+                bins[ty*TILES_X+tx].push_back( index );
+        }
+    }
 }
-void DrawPolygon( const vector<Vertex>& vertices )
+// Clears one tile and draws the triangles binned to it, in submission order.
+void DrawTile( int tile )
+{
+    alignas(SIMD_ALIGN) float depth[TILE_SIZE*TILE_SIZE];
+    static thread_local HierarchicalZ hiz;
+
+    RenderTarget target;
+    target.x0 = (tile%TILES_X)*TILE_SIZE;
+    target.y0 = (tile/TILES_X)*TILE_SIZE;
+    target.x1 = min( target.x0+TILE_SIZE, SCREEN_WIDTH );
+    target.y1 = min( target.y0+TILE_SIZE, SCREEN_HEIGHT );
+    target.depth = depth;
+    target.depthTilesX = TILE_SIZE/BUFFER_TILE;
+    target.color = &frameBuffer;
+    target.ids = 0;
+    target.pass = PASS_SHADE;
+    DepthCounts counts = { 0, 0 };
+    target.counts = &counts;
+    target.cleared = 0;
+    target.hiz = hizEnabled ? &hiz : 0;
+
+    if( hiz.Width() != target.x1-target.x0 || hiz.Height() != target.y1-target.y0 )
+        hiz.Resize( target.x1-target.x0, target.y1-target.y0 );
+    else
+        hiz.Clear();
+
+    for( int i=0; i<TILE_SIZE*TILE_SIZE; ++i )
+        depth[i] = 0;
+    for( int ty=target.y0/BUFFER_TILE; ty<TileCount( target.y1 ); ++ty )
+        for( int tx=target.x0/BUFFER_TILE; tx<TileCount( target.x1 ); ++tx )
+            frameBuffer.ClearTile( tx, ty );
+
+    for( size_t b=0; b<batchSetups.size(); ++b )
+    {
+        const vector<TriangleSetup>& setups = batchSetups[b];
+        const vector<int>& bin = tileBins[b*TILES+tile];
+        for( size_t i=0; i<bin.size(); ++i )
+            RasterizeTriangle( setups[bin[i]], target );
+    }
+    AddDepthCounts( counts );
+}
+// Sort-last rendering: the triangles are split into one contiguous range per
+// thread and each thread renders its range into a private full screen layer.
+// The layers are then merged by keeping the nearest fragment of each pixel.
+// Unlike tiling, the work stays balanced when the geometry covers only a
+// small part of the screen.
+void DrawSortLast()
+{
+    layers.resize( threadPool->Size() );
+
+    TaskGraph graph;
+    int shade = graph.Add( VertexBlocks(), ShadeVertexBlock );
+    int draw = graph.Add( int(layers.size()), DrawLayer );
+    int composite = graph.Add( SCREEN_TILES_Y, CompositeTileRow, 2 );
+    graph.Precede( shade, draw );
+    graph.Precede( draw, composite );
+    threadPool->Run( graph );
+
+    Present();
+}
+// Draws a share of the triangles into a layer, which is cleared lazily.
+void DrawLayer( int index )
+{
+    Layer& layer = layers[index];
+    if( layer.color.width != SCREEN_WIDTH )
+    {
+        layer.color.Resize( SCREEN_WIDTH, SCREEN_HEIGHT );
+        layer.depth.assign( layer.color.Size(), 0 );
+        layer.cleared.assign( CLEAR_BLOCKS, -1 );
+    }
+
+    RenderTarget target;
+    target.depth = &layer.depth[0];
+    target.depthTilesX = layer.color.tilesX;
+    target.color = &layer.color;
+    target.ids = 0;
+    target.pass = PASS_SHADE;
+    DepthCounts depth = { 0, 0 };
+    target.counts = &depth;
+    target.x0 = 0;
+    target.y0 = 0;
+    target.x1 = SCREEN_WIDTH;
+    target.y1 = SCREEN_HEIGHT;
+    target.hiz = hizEnabled ? &layer.hiz : 0;
+    target.cleared = &layer.cleared;
+
+    if( layer.hiz.Width() != SCREEN_WIDTH )
+        layer.hiz.Resize( SCREEN_WIDTH, SCREEN_HEIGHT );
+    else
+        layer.hiz.Clear();
+
+    CullCounts counts = { 0, 0, 0, 0 };
+    int count = int(visibleTriangles.size());
+    int begin = count*index/int(layers.size());
+    int end = count*(index+1)/int(layers.size());
+    for( int k=begin; k<end; k+=SETUP_GROUP )
+    {
+        TriangleSetup setups[SETUP_GROUP*MAX_CLIPPED_TRIANGLES];
+        int n = SetupGroup( k, min( k+SETUP_GROUP, end ), setups, counts );
+        for( int j=0; j<n; ++j )
+            RasterizeTriangle( setups[j], target );
+    }
+    FinishClear( target );
+    AddCullCounts( counts );
+    AddDepthCounts( depth );
+}
+// Writes the color of the layer with the largest 1/z to each pixel of a row
+// of tiles. The layers are tiled like the frame buffer, so this is a single
+// run of pixels, padding included.
+void CompositeTileRow( int ty )
+{
+    int begin = ty*SCREEN_TILES_X*TILE_PIXELS;
+    int end = begin + SCREEN_TILES_X*TILE_PIXELS;
+
+    for( int p=begin; p<end; ++p )
+    {
+        float zinv = layers[0].depth[p];
+        size_t nearest = 0;
+        for( size_t i=1; i<layers.size(); ++i )
+        {
+            if( layers[i].depth[p] > zinv )
+            {
+                zinv = layers[i].depth[p];
+                nearest = i;
+            }
+        }
+        const ColorBuffer& color = layers[nearest].color;
+        frameBuffer.r[p] = color.r[p];
+        frameBuffer.g[p] = color.g[p];
+        frameBuffer.b[p] = color.b[p];
+    }
+}
+// Fills a row of tiles of the G-buffer from the visibility buffer and lights
+// it. Position, normal and color come from the setup of the triangle seen at
+// each pixel, and pixels that no triangle covers still have the cleared
+// depth of 0.
+void ShadeVisibilityTileRow( int ty )
+{
+    int begin = ty*SCREEN_TILES_X*TILE_PIXELS;
+    int end = begin + SCREEN_TILES_X*TILE_PIXELS;
+    for( int i=begin; i<end; ++i )
+    {
+        float zinv = depthBuffer[i];
+        vec3 pos( 0 ), normal( 0 ), color( 0 );
+        if( zinv != 0 )
+        {
+            int tile = (i-begin)/TILE_PIXELS;
+            float x = float(tile*BUFFER_TILE + i%BUFFER_TILE);
+            float y = float(ty*BUFFER_TILE + i%TILE_PIXELS/BUFFER_TILE);
+            const TriangleSetup& s = frameSetups[visibilityBuffer[i]];
+            pos = (s.posA*x + s.posB*y + s.posC)/zinv;
+            normal = s.normal;
+            color = s.color;
+        }
+        gbuffer.x[i] = pos.x;
+        gbuffer.y[i] = pos.y;
+        gbuffer.z[i] = pos.z;
+        gbuffer.nx[i] = normal.x;
+        gbuffer.ny[i] = normal.y;
+        gbuffer.nz[i] = normal.z;
+        gbuffer.r[i] = color.r;
+        gbuffer.g[i] = color.g;
+        gbuffer.b[i] = color.b;
+    }
+    LightTileRow( ty );
+}
+// Redraws the screen from the G-buffer with the current light.
+void Relight()
+{
+    threadPool->ParallelFor( SCREEN_TILES_Y, LightTileRow, 2 );
+
+    Present();
+}
+// Lights a row of tiles of the G-buffer into the frame buffer, which is
+// tiled the same way, so the row is a single run of fragments.
+void LightTileRow( int ty )
+{
+    int begin = ty*SCREEN_TILES_X*TILE_PIXELS;
+    int end = begin + SCREEN_TILES_X*TILE_PIXELS;
+    LitColors lit = { &frameBuffer.r[begin], &frameBuffer.g[begin], &frameBuffer.b[begin] };
+    PointLight light = { lightPos, lightPower, indirectLightPowerPerArea };
+    LightFragments( light, gbuffer, begin, end, lit );
+
+    for( int i=begin; i<end; ++i )
+        if( depthBuffer[i] == 0 )
+            frameBuffer.r[i] = frameBuffer.g[i] = frameBuffer.b[i] = 0;
+}
+// Computes the camera space half-spaces a*x + b*y + c*z + d >= 0 of the
+// points in front of the near plane that project to at most margin pixels
+// outside the screen: the near plane followed by the left, right, top and
+// bottom planes, which follow from f*x/z + SCREEN_WIDTH/2 >= -margin etc.
+void ViewPlanes( float margin, vec4* planes )
+{
+    const float gx = SCREEN_WIDTH/2 + margin;
+    const float gy = SCREEN_HEIGHT/2 + margin;
+    planes[0] = vec4( 0, 0, 1, -NEAR_PLANE );
+    planes[1] = vec4( +f, 0, gx, 0 );
+    planes[2] = vec4( -f, 0, gx, 0 );
+    planes[3] = vec4( 0, +f, gy, 0 );
+    planes[4] = vec4( 0, -f, gy, 0 );
+}
+// Sets up the vertex transform for the current camera.
+void UpdateCamera()
+{
+    VertexTransform& t = vertexTransform;
+    t.rot = rot;
+    t.position = camPosition;
+    t.focal = f;
+    t.centerX = SCREEN_WIDTH/2;
+    t.centerY = SCREEN_HEIGHT/2;
+    t.frustum = frustumPlanes;
+    t.clip = clipPlanes;
+    t.planes = CLIP_PLANES;
+}
+// Finds the triangles and vertices in the view with the BVH. The frustum
+// planes are moved to world space the way the vertex stage moves points to
+// camera space: n.(p-camPosition)*rot = (rot*n).(p-camPosition).
+void CullScene()
+{
+    if( cullEnabled )
+    {
+        for( int i=0; i<CLIP_PLANES; ++i )
+        {
+            vec3 n = rot*vec3( frustumPlanes[i] );
+            worldFrustum[i] = vec4( n, frustumPlanes[i].w - glm::dot( n, camPosition ) );
+        }
+        // The occluders are drawn with the coverage of RasterizeTriangle,
+        // which the scanline rasterizer does not share.
+        if( occlusionEnabled && renderMode != RENDER_SCANLINE )
+        {
+            DrawOccluders();
+            CullBVH( bvh, worldFrustum, CLIP_PLANES, visible, NodeOccluded );
+        }
+        else
+            CullBVH( bvh, worldFrustum, CLIP_PLANES, visible );
+        cullCounts.tested += visible.culled + visible.occluded;
+        cullCounts.outside += visible.culled;
+        cullCounts.occluded += visible.occluded;
+    }
+    else
+    {
+        BVHRange all = { 0, mesh.TriangleCount() };
+        BVHRange vertices = { 0, mesh.VertexCount() };
+        visible.triangles.assign( 1, all );
+        visible.vertices.assign( 1, vertices );
+        visible.culled = 0;
+        visible.occluded = 0;
+    }
+
+    visibleTriangles.clear();
+    for( size_t i=0; i<visible.triangles.size(); ++i )
+        for( int j=visible.triangles[i].begin; j<visible.triangles[i].end; ++j )
+            visibleTriangles.push_back( j );
+}
+// Draws the occluders that face the camera into the occlusion buffer.
+void DrawOccluders()
+{
+    occlusionBuffer.Clear();
+    for( size_t i=0; i<occluders.size(); ++i )
+    {
+        int t = occluders[i];
+        if( glm::dot( mesh.normals[t], camPosition-mesh.Position( t, 0 ) ) <= 0 )
+            continue;
+        occlusionBuffer.DrawOccluder( vertexTransform, mesh.Position( t, 0 ),
+                                      mesh.Position( t, 1 ), mesh.Position( t, 2 ) );
+    }
+}
+bool NodeOccluded( const BVHNode& node )
+{
+    return occlusionBuffer.Occluded( vertexTransform, node.min, node.max );
+}
+// Orders the visible triangles front to back by the camera space depth of
+// their centers, so that near surfaces are drawn first and the fragments of
+// the ones behind fail the depth test before they are lit. The keys are
+// computed in parallel and sorted with a radix sort, which is linear in the
+// number of triangles.
+void SortTriangles()
+{
+    int count = int(visibleTriangles.size());
+    sortKeys.resize( count );
+    threadPool->ParallelFor( (count+SORT_BLOCK-1)/SORT_BLOCK, DepthKeys );
+    RadixSort( sortKeys, visibleTriangles );
+}
+// Computes the sort keys of a block of SORT_BLOCK visible triangles. The
+// depth is z of (p-camPosition)*rot. The bits of a non-negative float
+// compare like the float, so centers behind the camera are moved to 0.
+void DepthKeys( int block )
+{
+    vec3 axis = rot[2];
+    int end = min( (block+1)*SORT_BLOCK, int(visibleTriangles.size()) );
+    for( int k=block*SORT_BLOCK; k<end; ++k )
+    {
+        float z = max( glm::dot( triangleCenters[visibleTriangles[k]]-camPosition, axis ), 0.0f );
+        memcpy( &sortKeys[k], &z, sizeof(z) );
+    }
+}
+// Sorts values by keys, stable, one byte of the keys at a time. Bytes that
+// are the same in all keys are skipped.
+void RadixSort( vector<Uint32>& keys, vector<int>& values )
+{
+    int count = int(keys.size());
+    sortKeysTemp.resize( count );
+    sortTrianglesTemp.resize( count );
+    for( int shift=0; shift<32; shift+=8 )
+    {
+        int offsets[256] = { 0 };
+        for( int i=0; i<count; ++i )
+            ++offsets[(keys[i] >> shift) & 255];
+        if( count == 0 || offsets[(keys[0] >> shift) & 255] == count )
+            continue;
+
+        int sum = 0;
+        for( int b=0; b<256; ++b )
+        {
+            int n = offsets[b];
+            offsets[b] = sum;
+            sum += n;
+        }
+        for( int i=0; i<count; ++i )
+        {
+            int j = offsets[(keys[i] >> shift) & 255]++;
+            sortKeysTemp[j] = keys[i];
+            sortTrianglesTemp[j] = values[i];
+        }
+        keys.swap( sortKeysTemp );
+        values.swap( sortTrianglesTemp );
+    }
+}
+// Sets up the vertex stage for the vertices found by CullScene.
+void BeginVertexStage()
+{
+    shaded.Resize( mesh.VertexCount() );
+
+    // Split the vertex ranges into tasks. The vector code works on groups
+    // of SIMD_WIDTH vertices, so the ranges are widened to whole groups and
+    // merged again where that makes them overlap.
+    vector<BVHRange> ranges( visible.vertices );
+    for( size_t i=0; i<ranges.size(); ++i )
+    {
+        ranges[i].begin -= ranges[i].begin % SIMD_WIDTH;
+        ranges[i].end = min( int(PaddedSize( ranges[i].end )), mesh.VertexCount() );
+    }
+    MergeBVHRanges( ranges );
+    vertexBlocks.clear();
+    for( size_t i=0; i<ranges.size(); ++i )
+    {
+        for( int begin=ranges[i].begin; begin<ranges[i].end; begin+=VERTEX_BLOCK )
+        {
+            BVHRange block = { begin, min( begin+VERTEX_BLOCK, ranges[i].end ) };
+            vertexBlocks.push_back( block );
+        }
+    }
+}
+int VertexBlocks()
+{
+    return int(vertexBlocks.size());
+}
+// Vertex stage: transforms the vertices of the mesh to camera space once
+// per frame, classifies them against the frustum and the clip planes and
+// projects those that need no clipping for every triangle that uses them.
+void ShadeVertexBlock( int block )
+{
+    const BVHRange& r = vertexBlocks[block];
+    TransformVertices( mesh, vertexTransform, r.begin, r.end, shaded );
+}
+// Sets up the triangles visibleTriangles[begin,end), at most SETUP_GROUP of
+// them, for the edge function rasterizers and culls those CullTriangle
+// would. The ones that need no clipping are set up together by
+// SetupTriangles, the others are clipped one at a time. The results are
+// written to out in the order of the triangles, which takes at most
+// SETUP_GROUP*MAX_CLIPPED_TRIANGLES entries. Returns how many there are.
+int SetupGroup( int begin, int end, TriangleSetup* out, CullCounts& counts )
+{
+    SetupView view = { camPosition, SCREEN_WIDTH, SCREEN_HEIGHT, cullEnabled };
+    int count = end-begin;
+    SetupMasks m = SetupTriangles( mesh, shaded, view, &visibleTriangles[begin], count, out );
+    if( cullEnabled )
+    {
+        counts.tested += count;
+        counts.backFacing += MaskCount( m.backFacing );
+        counts.outside += MaskCount( m.outside );
+    }
+    int drawn = MaskCount( m.drawn );
+    if( m.clip == 0 )
+        return drawn;
+
+    // The clipped triangles go between the others, in order.
+    TriangleSetup group[SETUP_GROUP];
+    std::copy( out, out+drawn, group );
+    int n = 0;
+    int g = 0;
+    for( int i=0; i<count; ++i )
+    {
+        if( m.drawn & (1 << i) )
+            out[n++] = group[g++];
+        else if( m.clip & (1 << i) )
+            n += ClipTriangle( visibleTriangles[begin+i], out+n );
+    }
+    return n;
+}
+// Returns true if the triangle faces away from the camera or lies
+// completely outside one of the frustum planes, and counts why.
+bool CullTriangle( int index, CullCounts& counts )
+{
+    if( !cullEnabled )
+        return false;
+    ++counts.tested;
+
+    // The normals of the model point to the side the surface is seen from.
+    if( glm::dot( mesh.normals[index], camPosition-mesh.Position( index, 0 ) ) <= 0 )
+    {
+        ++counts.backFacing;
+        return true;
+    }
+
+    const int* v = &mesh.indices[3*index];
+    if( shaded.outside[v[0]] & shaded.outside[v[1]] & shaded.outside[v[2]] )
+    {
+        ++counts.outside;
+        return true;
+    }
+    return false;
+}
+void AddCullCounts( const CullCounts& counts )
+{
+    std::lock_guard<std::mutex> lock( cullMutex );
+    cullCounts.tested += counts.tested;
+    cullCounts.backFacing += counts.backFacing;
+    cullCounts.outside += counts.outside;
+}
+void AddDepthCounts( const DepthCounts& counts )
+{
+    std::lock_guard<std::mutex> lock( depthMutex );
+    depthCounts.tested += counts.tested;
+    depthCounts.failed += counts.failed;
+}
+// Sets up a triangle of the mesh that needs clipping for rasterization. It
+// is clipped and projected here, which can result in several triangles.
+// Returns how many were written to out, at most MAX_CLIPPED_TRIANGLES.
+int ClipTriangle( int index, TriangleSetup* out )
+{
+    const int* v = &mesh.indices[3*index];
+    ArenaScope scope( FrameMemory() );
+    Vertices polygon( 3, Vertex(), FrameMemory() );
+    polygon[0].position = mesh.positions[v[0]];
+    polygon[1].position = mesh.positions[v[1]];
+    polygon[2].position = mesh.positions[v[2]];
+    ClipPolygon( polygon );
+
+    int V = polygon.size();
+    Pixels vertexPixels( V, Pixel(), FrameMemory() );
+    for( int i=0; i<V; ++i )
+        ProjectVertex( polygon[i], vertexPixels[i] );
+
+    // The clipped polygon is convex, so it is split into a fan.
+    int n = 0;
+    for( int i=2; i<V; ++i )
+    {
+        TriangleSetup& s = out[n];
+        if( !SetupTriangle( vertexPixels[0], vertexPixels[i-1], vertexPixels[i], s ) )
+            continue;
+        s.color = mesh.colors[index];
+        s.normal = mesh.normals[index];
+        ++n;
+    }
+    return n;
+}
+// Clips a convex polygon against the near plane, so that every vertex can
+// be projected, and against the guard band, so that projected vertices are
+// at most GUARD_BAND pixels outside the screen. The guard band is wide
+// enough that almost every triangle skips that part; the rest is handled
+// by clamping the rasterization to the screen. The polygon is empty
+// afterwards if it is completely outside.
+void ClipPolygon( Vertices& polygon )
+{
+    const vec4* planes = clipPlanes;
+
+    // World and camera space positions are clipped together, so that the
+    // new vertices can go through the VertexShader like the others.
+    vec3 world[2][MAX_CLIPPED_VERTICES];
+    vec3 local[2][MAX_CLIPPED_VERTICES];
+    int V = polygon.size();
+    for( int i=0; i<V; ++i )
+    {
+        world[0][i] = polygon[i].position;
+        local[0][i] = (polygon[i].position-camPosition)*rot;
+    }
+
+    int in = 0;
+    for( int p=0; p<CLIP_PLANES && V > 0; ++p )
+    {
+        float distance[MAX_CLIPPED_VERTICES];
+        bool inside = true;
+        for( int i=0; i<V; ++i )
+        {
+            distance[i] = glm::dot( vec3(planes[p]), local[in][i] ) + planes[p].w;
+            inside = inside && distance[i] >= 0;
+        }
+        if( inside )
+            continue;
+
+        // Sutherland-Hodgman: keep the vertices inside and add one vertex
+        // where an edge crosses the plane.
+        int out = 1-in;
+        int n = 0;
+        for( int i=0; i<V; ++i )
+        {
+            int j = (i+1)%V;
+            if( distance[i] >= 0 )
+            {
+                world[out][n] = world[in][i];
+                local[out][n] = local[in][i];
+                ++n;
+            }
+            if( (distance[i] >= 0) != (distance[j] >= 0) )
+            {
+                float t = distance[i] / (distance[i]-distance[j]);
+                world[out][n] = world[in][i] + t*(world[in][j]-world[in][i]);
+                local[out][n] = local[in][i] + t*(local[in][j]-local[in][i]);
+                ++n;
+            }
+        }
+        V = n;
+        in = out;
+    }
+
+    polygon.resize( V );
+    for( int i=0; i<V; ++i )
+        polygon[i].position = world[in][i];
+}
+void DrawPolygon( const Vertices& vertices )
 {
     int V = vertices.size();
-    vector<Pixel> vertexPixels( V );
+    Pixels vertexPixels( V, Pixel(), FrameMemory() );
     for( int i=0; i<V; ++i )
         VertexShader( vertices[i], vertexPixels[i] );
-    
-    vector<Pixel> leftPixels;
-    vector<Pixel> rightPixels;
+    DrawPixels( vertexPixels );
+}
+// Draws a triangle of the mesh that needs no clipping with the scanline
+// rasterizer, from the vertices projected by the vertex stage. The pixel of
+// a vertex is the one its subpixel position lies in.
+void DrawShadedTriangle( int index )
+{
+    const int* v = &mesh.indices[3*index];
+    Pixels vertexPixels( 3, Pixel(), FrameMemory() );
+    for( int k=0; k<3; ++k )
+    {
+        vertexPixels[k].x = shaded.x[v[k]] >> SUBPIXEL_BITS;
+        vertexPixels[k].y = shaded.y[v[k]] >> SUBPIXEL_BITS;
+        vertexPixels[k].zinv = shaded.zinv[v[k]];
+        vertexPixels[k].pos3d = mesh.positions[v[k]];
+    }
+    DrawPixels( vertexPixels );
+}
+void DrawPixels( const Pixels& vertexPixels )
+{
+    Pixels leftPixels( FrameMemory() );
+    Pixels rightPixels( FrameMemory() );
     
     ComputePolygonRows( vertexPixels, leftPixels, rightPixels );
         DrawRows( leftPixels, rightPixels );
@@ -244,12 +1440,22 @@ void VertexShader( const Vertex& v, Pixel& p )
 
 
 }
+// Projects a vertex like VertexShader, but to subpixels as the vertex stage
+// does, for SetupTriangle.
+void ProjectVertex( const Vertex& v, Pixel& p )
+{
+    vec3 local = (v.position-camPosition)*rot;
+    p.zinv = 1/local.z;
+    p.x = ToSubpixels( (f * local.x * p.zinv)+SCREEN_WIDTH/2 );
+    p.y = ToSubpixels( (f * local.y * p.zinv)+SCREEN_HEIGHT/2 );
+    p.pos3d = v.position;
+}
 
 
 void ComputePolygonRows(
-                        const vector<Pixel>& vertexPixels,
-                        vector<Pixel>& leftPixels,
-                        vector<Pixel>& rightPixels )
+                        const Pixels& vertexPixels,
+                        Pixels& leftPixels,
+                        Pixels& rightPixels )
 {
     // 1. Find max and min y-value of the polygon
     // and compute the number of rows it occupies.
@@ -263,7 +1469,11 @@ void ComputePolygonRows(
         max = vertexPixels[i].y > max ? vertexPixels[i].y : max;
         min = vertexPixels[i].y < min ? vertexPixels[i].y : min;
     }
-    int ROWS = max-min+1;
+
+    // Rows outside the screen are skipped.
+    min = min > 0 ? min : 0;
+    max = max < SCREEN_HEIGHT-1 ? max : SCREEN_HEIGHT-1;
+    int ROWS = max >= min ? max-min+1 : 0;
 
     // 2. Resize leftPixels and rightPixels
     // so that they have an element for each row.
@@ -290,10 +1500,12 @@ void ComputePolygonRows(
     {
         int j = (i+1)%V;                    // The next vertex
         int EDGE_ROWS = abs( vertexPixels[i].y - vertexPixels[j].y ) +1;
-        vector<Pixel> result(EDGE_ROWS);
+        Pixels result( EDGE_ROWS, Pixel(), FrameMemory() );
         Interpolate(vertexPixels[i], vertexPixels[j], result);
         for (int i = 0; i < result.size(); ++i){
             int row = result[i].y-min;
+            if( row < 0 || row >= ROWS )
+                continue;
             leftPixels[row].y = result[i].y;
 
             if (result[i].x < leftPixels[row].x){
@@ -312,7 +1524,7 @@ void ComputePolygonRows(
         }
     }
 }
-void Interpolate( Pixel a, Pixel b, vector<Pixel>& result )
+void Interpolate( Pixel a, Pixel b, Pixels& result )
 {
     int N = result.size();
     vec3 diff = vec3(b.x-a.x,b.y-a.y,b.zinv-a.zinv) / float(max(N-1,1));
@@ -335,14 +1547,80 @@ void Interpolate( Pixel a, Pixel b, vector<Pixel>& result )
     }
 }
 
+// Interpolates a row like Interpolate, except that pos3d*zinv is divided by
+// zinv only every spanStep pixels and at the end of the row, and pos3d is
+// interpolated linearly in between. Over a segment from p0 to p1 the error
+// of that at t in [0,1] is (p1-p0)*t*(1-t)*(zinv1-zinv0)/zinv(t), which is at
+// most |p1-p0|*|zinv1-zinv0|/(4*min( zinv0, zinv1 )); the largest bound is
+// kept in spanError.
+void InterpolateSpan( Pixel a, Pixel b, Pixels& result )
+{
+    if( spanStep <= 1 )
+    {
+        Interpolate( a, b, result );
+        return;
+    }
+
+    int N = result.size();
+    vec3 diff = vec3(b.x-a.x,b.y-a.y,b.zinv-a.zinv) / float(max(N-1,1));
+    vec3 diffPos = vec3(b.pos3d*b.zinv - a.pos3d*a.zinv) / float(max(N-1,1));
+
+    vec3 current( a.x, a.y, a.zinv);
+    vec3 currentPos(a.pos3d*a.zinv);
+
+    for( int i=0; i<N; ++i )
+    {
+        result[i].x = current.x;
+        result[i].y = current.y;
+        result[i].zinv = current.z;
+        result[i].pos3d = currentPos;       // Divided by zinv below
+
+        current.x += diff.x;
+        current.y += diff.y;
+        current.z += diff.z;
+        currentPos += diffPos;
+    }
+
+    float startRecip = 1/result[0].zinv;
+    vec3 start = result[0].pos3d*startRecip;
+    result[0].pos3d = start;
+    for( int i=0; i<N-1; )
+    {
+        int end = min( i+spanStep, N-1 );
+        float endRecip = 1/result[end].zinv;
+        vec3 endPos = result[end].pos3d*endRecip;
+        vec3 step = (endPos-start)/float(end-i);
+        for( int k=i+1; k<end; ++k )
+            result[k].pos3d = start + float(k-i)*step;
+        result[end].pos3d = endPos;
+
+        float bound = glm::length( endPos-start )*abs( result[end].zinv-result[i].zinv )*max( startRecip, endRecip )/4;
+        spanError = max( spanError, bound );
+        start = endPos;
+        startRecip = endRecip;
+        i = end;
+    }
+}
+
 void DrawRows(
-              const vector<Pixel>& leftPixels,
-              const vector<Pixel>& rightPixels )
+              const Pixels& leftPixels,
+              const Pixels& rightPixels )
 {
     for (int i = 0; i < leftPixels.size(); ++i) {
         if (rightPixels[i].x != -numeric_limits<int>::max() && leftPixels[i].x != +numeric_limits<int>::max() ) {
-            vector<Pixel> rowPixels(rightPixels[i].x-leftPixels[i].x+1);
-            Interpolate(leftPixels[i], rightPixels[i], rowPixels);
+            // Only the part of the row on the screen is interpolated.
+            if( rightPixels[i].x < 0 || leftPixels[i].x >= SCREEN_WIDTH )
+                continue;
+            Pixel left = leftPixels[i];
+            Pixel right = rightPixels[i];
+            if( left.x < 0 )
+                left = SpanPixel( leftPixels[i], rightPixels[i], 0 );
+            if( right.x >= SCREEN_WIDTH )
+                right = SpanPixel( leftPixels[i], rightPixels[i], SCREEN_WIDTH-1 );
+
+            ArenaScope scope( FrameMemory() );
+            Pixels rowPixels( right.x-left.x+1, Pixel(), FrameMemory() );
+            InterpolateSpan(left, right, rowPixels);
             for( int j = 0; j < rowPixels.size(); ++j) {
                 PixelShader(rowPixels[j]);
             }
@@ -350,25 +1628,225 @@ void DrawRows(
     }
 }
 
+// Returns the pixel at column x of the row from a to b, with 1/z and
+// pos3d/z interpolated linearly like Interpolate does.
+Pixel SpanPixel( const Pixel& a, const Pixel& b, int x )
+{
+    float t = float(x-a.x) / (b.x-a.x);
+    Pixel p;
+    p.x = x;
+    p.y = a.y;
+    p.zinv = a.zinv + t*(b.zinv-a.zinv);
+    p.pos3d = (a.pos3d*a.zinv + t*(b.pos3d*b.zinv-a.pos3d*a.zinv)) / p.zinv;
+    return p;
+}
+
+// Sets up a screen space triangle with its vertices in subpixels, see
+// ProjectVertex, like SetupScreenTriangle does.
+bool SetupTriangle(
+                   const Pixel& v0,
+                   const Pixel& v1,
+                   const Pixel& v2,
+                   TriangleSetup& s )
+{
+    int x[3] = { v0.x, v1.x, v2.x };
+    int y[3] = { v0.y, v1.y, v2.y };
+    float zinv[3] = { v0.zinv, v1.zinv, v2.zinv };
+    vec3 pos[3] = { v0.pos3d*v0.zinv, v1.pos3d*v1.zinv, v2.pos3d*v2.zinv };
+    return SetupScreenTriangle( x, y, zinv, pos, SCREEN_WIDTH, SCREEN_HEIGHT, s );
+}
+
+// Walks the bounding box of the triangle, clipped to the target, in the
+// blocks of the hierarchical depth buffer. The whole triangle is dropped if
+// the coarse levels show that it is behind what is already drawn, and so is
+// every block that lies outside one of its edges or behind the nearest
+// depth stored in it. Blocks whose stored depth is all behind the triangle
+// skip the per-pixel depth test, except in PASS_EQUAL, which leaves the
+// depth buffer and its summary as they are.
+void RasterizeTriangle( const TriangleSetup& s, const RenderTarget& target )
+{
+    int minX = max( s.minX, target.x0 );
+    int minY = max( s.minY, target.y0 );
+    int maxX = min( s.maxX, target.x1-1 );
+    int maxY = min( s.maxY, target.y1-1 );
+    if( minX > maxX || minY > maxY )
+        return;
+
+    HierarchicalZ* hiz = target.hiz;
+    if( hiz && hiz->Occluded( minX-target.x0, minY-target.y0, maxX-target.x0, maxY-target.y0,
+                              PlaneMax( s.zinv, minX, minY, maxX, maxY )*(1+HIZ_SLACK) ) )
+        return;
+
+    for( int by = (minY-target.y0)/HIZ_BLOCK; by <= (maxY-target.y0)/HIZ_BLOCK; ++by )
+    {
+        int y0 = max( minY, target.y0 + by*HIZ_BLOCK );
+        int y1 = min( maxY, target.y0 + by*HIZ_BLOCK + HIZ_BLOCK-1 );
+        for( int bx = (minX-target.x0)/HIZ_BLOCK; bx <= (maxX-target.x0)/HIZ_BLOCK; ++bx )
+        {
+            int x0 = max( minX, target.x0 + bx*HIZ_BLOCK );
+            int x1 = min( maxX, target.x0 + bx*HIZ_BLOCK + HIZ_BLOCK-1 );
+
+            if( EdgeMax( s.edge[0], x0, y0, x1, y1 ) < 0 ||
+                EdgeMax( s.edge[1], x0, y0, x1, y1 ) < 0 ||
+                EdgeMax( s.edge[2], x0, y0, x1, y1 ) < 0 )
+                continue;
+
+            bool depthTest = true;
+            if( hiz )
+            {
+                if( PlaneMax( s.zinv, x0, y0, x1, y1 )*(1+HIZ_SLACK) <= hiz->Min( bx, by ) )
+                    continue;
+                depthTest = target.pass == PASS_EQUAL ||
+                    PlaneMin( s.zinv, x0, y0, x1, y1 )*(1-HIZ_SLACK) <= hiz->Max( bx, by );
+            }
+
+            if( target.cleared )
+                TouchBlock( target, bx, by );
+            float written = RasterizeBlock( s, target, x0, y0, x1, y1, depthTest );
+            if( hiz && written > 0 && target.pass != PASS_EQUAL )
+                hiz->Update( bx, by, BlockMinDepth( target, bx, by ), written );
+        }
+    }
+}
+// Shades every pixel of the rectangle [x0,x1] x [y0,y1] for which all three
+// edge functions are non-negative and, if depthTest is set, that passes the
+// depth test. The rectangle lies within one tile, and each of its rows is
+// rasterized as a whole row of the tile by RasterRow. The pixels that pass
+// are gathered into a batch, which is lit with LightFragments at the end.
+// Returns the largest 1/z written, or 0 if nothing was.
+//
+// PASS_DEPTH writes the depth alone. In PASS_EQUAL the test is for a 1/z
+// equal to the stored one, which RasterRow computes the same way in both
+// passes. The depth of a shaded pixel is then negated, so that a second
+// triangle with the same depth there does not shade it again and the first
+// one drawn is seen, as in PASS_SHADE.
+float RasterizeBlock( const TriangleSetup& s, const RenderTarget& target,
+                      int x0, int y0, int x1, int y1, bool depthTest )
+{
+    const bool equal = target.pass == PASS_EQUAL;
+    const bool shade = target.pass != PASS_DEPTH && !target.ids;
+    DepthTest test = equal ? DEPTH_EQUAL : depthTest ? DEPTH_GREATER : DEPTH_ALWAYS;
+    int tileX = x0 - (x0-target.x0)%BUFFER_TILE;
+    float written = 0;
+    int tested = 0;
+    int failed = 0;
+    FragmentBatch<TILE_PIXELS> batch;
+    int pixels[TILE_PIXELS];                // Of the fragments in batch
+    int count = 0;
+    for( int y = y0; y <= y1; ++y )
+    {
+        float fx = tileX;
+        RasterRowPlanes planes;
+        for( int i=0; i<3; ++i )
+        {
+            planes.edge[i] = RowEdge( s.edge[i], tileX, y );
+            planes.edgeStep[i] = s.edge[i].a;
+        }
+        planes.zinv = s.zinv.x*fx + s.zinv.y*y + s.zinv.z;
+        planes.zinvStep = s.zinv.x;
+
+        float* depth = target.depth + TiledIndex( target.depthTilesX, tileX-target.x0, y-target.y0 );
+        int* ids = target.ids ? target.ids + (depth-target.depth) : 0;
+        RasterRowResult row = RasterRow( planes, x0-tileX, x1-tileX, test, depth, ids, s.id );
+        tested += row.tested;
+        failed += row.failed;
+        written = max( written, row.written );
+
+        if( shade && row.passed )
+        {
+            int pixel = target.color->Index( tileX, y );
+            for( int i=0; i<RASTER_ROW; ++i )
+            {
+                if( !(row.passed & (1 << i)) )
+                    continue;
+                vec3 pos = (s.posA*float(tileX+i) + s.posB*float(y) + s.posC)/RasterRowZinv( planes, i );
+                batch.x[count] = pos.x;
+                batch.y[count] = pos.y;
+                batch.z[count] = pos.z;
+                batch.nx[count] = s.normal.x;
+                batch.ny[count] = s.normal.y;
+                batch.nz[count] = s.normal.z;
+                batch.r[count] = s.color.r;
+                batch.g[count] = s.color.g;
+                batch.b[count] = s.color.b;
+                pixels[count++] = pixel+i;
+            }
+        }
+    }
+
+    if( count > 0 )
+    {
+        alignas(SIMD_ALIGN) float r[TILE_PIXELS], g[TILE_PIXELS], b[TILE_PIXELS];
+        LitColors lit = { r, g, b };
+        PointLight light = { lightPos, lightPower, indirectLightPowerPerArea };
+        batch.Pad( count );
+        LightFragments( light, batch, 0, count, lit );
+        for( int i=0; i<count; ++i )
+        {
+            target.color->r[pixels[i]] = r[i];
+            target.color->g[pixels[i]] = g[i];
+            target.color->b[pixels[i]] = b[i];
+        }
+    }
+    // The depth pass has counted these fragments already.
+    if( !equal )
+    {
+        target.counts->tested += tested;
+        target.counts->failed += failed;
+    }
+    return written;
+}
+// Smallest 1/z stored in a block of the hierarchical depth buffer.
+float BlockMinDepth( const RenderTarget& target, int bx, int by )
+{
+    int x0 = bx*HIZ_BLOCK;
+    int y0 = by*HIZ_BLOCK;
+    int x1 = min( x0+HIZ_BLOCK, target.x1-target.x0 );
+    int y1 = min( y0+HIZ_BLOCK, target.y1-target.y0 );
+
+    float m = target.depth[TiledIndex( target.depthTilesX, x0, y0 )];
+    for( int y = y0; y < y1; ++y )
+        for( int x = x0; x < x1; ++x )
+            m = min( m, target.depth[TiledIndex( target.depthTilesX, x, y )] );
+    return m;
+}
+// Largest and smallest value of the plane q.x*x + q.y*y + q.z over the
+// rectangle [x0,x1] x [y0,y1].
+float PlaneMax( const vec3& q, int x0, int y0, int x1, int y1 )
+{
+    return q.x*(q.x > 0 ? x1 : x0) + q.y*(q.y > 0 ? y1 : y0) + q.z;
+}
+float PlaneMin( const vec3& q, int x0, int y0, int x1, int y1 )
+{
+    return q.x*(q.x > 0 ? x0 : x1) + q.y*(q.y > 0 ? y0 : y1) + q.z;
+}
+
 void PixelShader( const Pixel& p )
 {
     int x = p.x;
     int y = p.y;
-    if( x < SCREEN_WIDTH && x >= 0 && y < SCREEN_HEIGHT && y >= 0 && p.zinv > depthBuffer[y][x] )
+    if( x < SCREEN_WIDTH && x >= 0 && y < SCREEN_HEIGHT && y >= 0 )
     {
-        depthBuffer[y][x] = p.zinv;
-        PutPixelSDL( screen, x, y, Light(p)*color);
+        ++depthCounts.tested;
+        int i = ScreenIndex( x, y );
+        if( p.zinv > depthBuffer[i] )
+        {
+            depthBuffer[i] = p.zinv;
+            frameBuffer.Set( x, y, Light(p, currentNormal)*color );
+        }
+        else
+            ++depthCounts.failed;
     }
 }
 
-vec3 Light( const Pixel& i )
+vec3 Light( const Pixel& i, const vec3& normal )
 {
     vec3 r = lightPos - i.pos3d ;
     vec3 rHat = glm::normalize(r);
 
     float rLength = glm::length(r);
 
-    float rRatio = glm::dot(rHat,currentNormal);
+    float rRatio = glm::dot(rHat,normal);
     float ratio = rRatio >= 0 ? rRatio : 0;
 
     float A = (4*3.14*rLength*rLength);